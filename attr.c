@@ -15,10 +15,8 @@ strip(char *name)
 	size_t len;
 
 	len = strlen(name);
-	if (len >= 4 && name[0] == '_' && name[1] == '_' && name[len - 2] == '_' && name[len - 1] == '_') {
-		name[len - 2] = '\0';
-		name += 2;
-	}
+	if (len >= 4 && name[0] == '_' && name[1] == '_' && name[len - 2] == '_' && name[len - 1] == '_')
+		name = intern(name + 2, len - 4)->name;
 	return name;
 }
 
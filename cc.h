@@ -8,6 +8,9 @@ enum tokenkind {
 	TEOF,
 	TNEWLINE,
 	TOTHER,
+	/* macro parameter, and '#' applied to one, in a replacement list */
+	TPARAM,
+	TPARAMSTR,
 
 	TIDENT,
 	TNUMBER,
@@ -135,6 +138,8 @@ struct token {
 	bool hide;
 	/* whether or not the token was preceeded by a space */
 	bool space;
+	/* index of the macro parameter, for TPARAM and TPARAMSTR */
+	unsigned short param;
 	struct location loc;
 	char *lit;
 };
@@ -193,7 +198,6 @@ struct member {
 	enum typequal qual;
 	unsigned long long offset;
 	struct bitfield bits;
-	struct member *next;
 };
 
 struct type {
@@ -207,6 +211,10 @@ struct type {
 	/* qualifiers of the base type */
 	enum typequal qual;
 	bool incomplete, flexible;
+	/* allocated while parsing a function body */
+	bool local;
+	/* interned pointer and array types with this base type */
+	struct type *derived, *sibling;
 	union {
 		struct {
 			bool issigned, iscomplex;
@@ -218,12 +226,15 @@ struct type {
 		} array;
 		struct {
 			bool isvararg;
-			struct decl *params;
+			struct decl **params;
 			size_t nparam;
 		} func;
 		struct {
 			char *tag;
 			struct member *members;
+			size_t nmember;
+			/* hash index of members, for large structs and unions */
+			struct memberindex *index;
 		} structunion;
 	} u;
 };
@@ -293,12 +304,14 @@ struct decl {
 };
 
 struct scope {
-	struct map tags;
-	struct map decls;
+	/* declarations and tags in this scope */
+	struct binding *bindings;
 	struct block *breaklabel;
 	struct block *continuelabel;
 	struct switchcases *switchcases;
 	struct scope *parent;
+	/* number of enclosing scopes */
+	unsigned depth;
 };
 
 enum exprkind {
@@ -332,20 +345,24 @@ struct stringlit {
 	void *data;
 };
 
+/*
+Expression nodes are allocated with only the part of the union used
+by their kind (see mkexpr), so fields of u must only be accessed
+according to the kind.
+*/
 struct expr {
 	enum exprkind kind;
+	/* operator of a unary, binary, or increment/decrement expression (enum tokenkind) */
+	unsigned char op;
+	/* the type qualifiers of the object this expression refers to, ignored for non-lvalues (enum typequal) */
+	unsigned char qual;
 	/* whether this expression is an lvalue */
 	bool lvalue;
 	/* whether this expression is a pointer decayed from an array or function designator */
 	bool decayed;
 	/* the unqualified type of the expression */
 	struct type *type;
-	/* the type qualifiers of the object this expression refers to (ignored for non-lvalues) */
-	enum typequal qual;
-	enum tokenkind op;
 	struct expr *base;
-	struct expr *next;
-	struct expr *toeval;
 	union {
 		struct {
 			struct decl *decl;
@@ -357,7 +374,7 @@ struct expr {
 		} constant;
 		struct stringlit string;
 		struct {
-			struct expr *args;
+			struct expr **args;
 			size_t nargs;
 		} call;
 		struct {
@@ -366,10 +383,15 @@ struct expr {
 		struct {
 			struct decl *decl;
 			struct init *init;
+			/* side effects of a variably modified type name */
+			struct expr *toeval;
 		} compound;
 		struct {
 			bool post;
 		} incdec;
+		struct {
+			struct expr *toeval;
+		} cast;
 		struct {
 			struct expr *l, *r;
 		} binary;
@@ -379,8 +401,12 @@ struct expr {
 		struct {
 			struct expr *l, *r;
 		} assign;
+		struct {
+			struct expr *l, *r;
+		} comma;
 		struct {
 			enum builtinkind kind;
+			struct expr *toeval;
 		} builtin;
 		struct {
 			struct type *type;
@@ -398,30 +424,63 @@ struct init {
 
 /* token */
 
+/* unique identifier spelling */
+struct atom {
+	/* keyword token kind, or TIDENT */
+	enum tokenkind kind;
+	/* macro definition, if any */
+	struct macro *macro;
+	/* innermost declaration and tag with this name */
+	struct binding *decl, *tag;
+	/* precomputed map key for the name */
+	struct mapkey key;
+	char name[];
+};
+
+#define atomof(s) (listelement(s, struct atom, name))
+
 extern struct token tok;
 extern const char *tokstr[];
 
+struct atom *intern(const char *, size_t);
+
 void tokenprint(const struct token *);
+void tokenflush(void);
 char *tokencheck(const struct token *, enum tokenkind, const char *);
 void error(const struct location *, const char *, ...);
+void warning(const struct location *, const char *, ...);
 
 /* scan */
 
 void scanfrom(const char *, FILE *);
+void scanbuffer(const char *, char *, size_t);
 void scanopen(void);
+bool scaninclude(const char *);
+const char *scanname(void);
+size_t scandepth(void);
+bool scanateof(void);
 void scansetloc(struct location loc);
 void scan(struct token *);
+void scanskipped(struct token *);
+bool scantoken(char *, size_t, struct token *);
 
 /* preprocessor */
 
 enum ppflags {
 	/* preserve newlines in preprocessor output */
-	PPNEWLINE   = 1 << 0,
+	PPNEWLINE     = 1 << 0,
+	/* collect statistics for ppstats */
+	PPSTATS       = 1 << 1,
+	/* emit linemarkers in preprocessor output */
+	PPLINEMARKERS = 1 << 2,
 };
 
 extern enum ppflags ppflags;
 
 void ppinit(void);
+void ppincludedir(char *);
+void ppcachedir(char *);
+void ppstats(FILE *);
 
 void next(void);
 bool peek(int);
@@ -435,6 +494,8 @@ struct type *mkpointertype(struct type *, enum typequal);
 struct type *mkarraytype(struct type *, enum typequal, unsigned long long);
 
 bool typecompatible(struct type *, struct type *);
+void typeclearcache(bool);
+void typestats(FILE *);
 bool typesame(struct type *, struct type *);
 struct type *typecomposite(struct type *, struct type *);
 struct type *typeunqual(struct type *, enum typequal *);
@@ -443,6 +504,8 @@ struct type *typepromote(struct type *, unsigned);
 struct type *typeadjust(struct type *, enum typequal *);
 enum typeprop typeprop(struct type *);
 struct member *typemember(struct type *, const char *, unsigned long long *);
+struct member *typedirectmember(struct type *, const char *);
+void typeindexmembers(struct type *);
 bool typehasint(struct type *, unsigned long long, bool);
 
 extern struct type typevoid;
@@ -491,6 +554,11 @@ bool gnuattr(struct attr *, enum attrkind);
 
 /* decl */
 
+/* memory for the whole translation unit */
+extern struct arena tuarena;
+/* memory for the current function definition (or tuarena outside of one) */
+extern struct arena *funcarena;
+
 struct decl *mkdecl(char *name, enum declkind, struct type *, enum typequal, enum linkage);
 bool decl(struct scope *, struct func *);
 struct type *typename(struct scope *, enum typequal *, struct expr **);
@@ -504,6 +572,8 @@ void emittentativedefns(void);
 void scopeinit(void);
 struct scope *mkscope(struct scope *);
 struct scope *delscope(struct scope *);
+struct scope *closescope(struct scope *);
+struct scope *reopenscope(struct scope *);
 
 void scopeputdecl(struct scope *, struct decl *);
 struct decl *scopegetdecl(struct scope *, const char *, bool);
@@ -516,15 +586,16 @@ extern struct scope filescope;
 /* expr */
 
 struct type *stringconcat(struct stringlit *, bool);
+struct type *charconstvalue(const char *, unsigned long long *, struct location *);
 
 struct expr *expr(struct scope *);
 struct expr *assignexpr(struct scope *);
 struct expr *condexpr(struct scope *);
 unsigned long long intconstexpr(struct scope *, bool);
-void delexpr(struct expr *);
 
 struct expr *exprassign(struct expr *, struct type *);
 struct expr *exprpromote(struct expr *);
+void exprstats(FILE *);
 
 /* eval */
 
@@ -8,6 +8,9 @@
 #include "util.h"
 #include "cc.h"
 
+struct arena tuarena, *funcarena = &tuarena;
+
+static struct arena bodyarena;
 static struct decl *tentativedefns, **tentativedefnsend = &tentativedefns;
 
 struct qualtype {
@@ -55,7 +58,7 @@ enum funcspec {
 
 struct structbuilder {
 	struct type *type;
-	struct member **last;
+	struct array members;
 	unsigned bits;  /* number of bits remaining in the last byte */
 	bool pack;
 };
@@ -65,7 +68,7 @@ mkdecl(char *name, enum declkind k, struct type *t, enum typequal tq, enum linka
 {
 	struct decl *d;
 
-	d = xmalloc(sizeof(*d));
+	d = arenaalloc(funcarena, sizeof(*d));
 	memset(d, 0, sizeof(*d));
 	d->name = name;
 	d->kind = k;
@@ -206,6 +209,8 @@ tagspec(struct scope *s)
 			t->align = 0;
 			t->u.structunion.tag = tag;
 			t->u.structunion.members = NULL;
+			t->u.structunion.nmember = 0;
+			t->u.structunion.index = NULL;
 		}
 		t->incomplete = true;
 		if (tag)
@@ -220,16 +225,21 @@ tagspec(struct scope *s)
 	case TYPESTRUCT:
 	case TYPEUNION:
 		b.type = t;
-		b.last = &t->u.structunion.members;
+		b.members = (struct array){0};
 		b.bits = 0;
 		b.pack = a.kind & ATTRPACKED;
 		do structdecl(s, &b);
 		while (tok.kind != TRBRACE);
-		if (!t->u.structunion.members)
+		if (b.members.len == 0)
 			error(&tok.loc, "struct/union has no members");
 		next();
+		t->u.structunion.members = arenaalloc(funcarena, b.members.len);
+		memcpy(t->u.structunion.members, b.members.val, b.members.len);
+		t->u.structunion.nmember = b.members.len / sizeof(struct member);
+		free(b.members.val);
 		if (!b.pack)
 			t->size = ALIGNUP(t->size, t->align);
+		typeindexmembers(t);
 		break;
 	case TYPEENUM:
 		enumconsts = NULL;
@@ -535,7 +545,8 @@ declaratortypes(struct scope *s, struct list *result, char **name, struct scope
 {
 	struct list *ptr, *prev;
 	struct type *t;
-	struct decl *d, **paramend;
+	struct decl *d;
+	struct array params;
 	struct expr *e;
 	enum typequal tq;
 	bool allowattr;
@@ -595,7 +606,7 @@ declaratortypes(struct scope *s, struct list *result, char **name, struct scope
 			t->u.func.isvararg = false;
 			t->u.func.params = NULL;
 			t->u.func.nparam = 0;
-			paramend = &t->u.func.params;
+			params = (struct array){0};
 			s = mkscope(s);
 			d = NULL;
 			do {
@@ -608,22 +619,24 @@ declaratortypes(struct scope *s, struct list *result, char **name, struct scope
 				d = parameter(s);
 				if (d->name)
 					scopeputdecl(s, d);
-				*paramend = d;
-				paramend = &d->next;
-				++t->u.func.nparam;
+				arrayaddptr(&params, d);
 			} while (consume(TCOMMA));
 			expect(TRPAREN, "to close function declarator");
 			if (funcscope && ptr->prev == prev) {
 				/* we may need to re-open the scope later if this is a function definition */
 				*funcscope = s;
-				s = s->parent;
+				s = closescope(s);
 			} else {
 				s = delscope(s);
 			}
-			if (t->u.func.nparam == 1 && !t->u.func.isvararg && d->type->kind == TYPEVOID && !d->name) {
-				t->u.func.params = NULL;
-				t->u.func.nparam = 0;
+			if (params.len == sizeof(d) && !t->u.func.isvararg && d->type->kind == TYPEVOID && !d->name)
+				params.len = 0;
+			if (params.len > 0) {
+				t->u.func.params = arenaalloc(funcarena, params.len);
+				memcpy(t->u.func.params, params.val, params.len);
+				t->u.func.nparam = params.len / sizeof(d);
 			}
+			free(params.val);
 			listinsert(ptr->prev, &t->link);
 			allowattr = true;
 			break;
@@ -680,6 +693,9 @@ declarator(struct scope *s, struct qualtype base, char **name, struct scope **fu
 		t->qual = base.qual;
 		t->prop |= base.type->prop & PROPVM;
 		switch (t->kind) {
+		case TYPEPOINTER:
+			t = mkpointertype(base.type, base.qual);
+			break;
 		case TYPEFUNC:
 			if (base.type->kind == TYPEFUNC)
 				error(&tok.loc, "function declarator specifies function return type");
@@ -701,6 +717,8 @@ declarator(struct scope *s, struct qualtype base, char **name, struct scope **fu
 					if (e->u.constant.u > ULLONG_MAX / base.type->size)
 						error(&tok.loc, "array length is too large");
 					t->size = base.type->size * e->u.constant.u;
+					if (t->size && !(t->prop & PROPVM) && t->u.array.ptrqual == QUALNONE)
+						t = mkarraytype(base.type, base.qual, e->u.constant.u);
 				} else {
 					t->prop |= PROPVM;
 					t->u.array.length = e;
@@ -762,13 +780,10 @@ addmember(struct structbuilder *b, struct qualtype mt, char *name, int align, un
 		error(&tok.loc, "struct member '%s' has variably modified type", name);
 	assert(mt.type->align > 0);
 	if (name || width == -1) {
-		m = xmalloc(sizeof(*m));
+		m = arrayadd(&b->members, sizeof(*m));
 		m->type = mt.type;
 		m->qual = mt.qual;
 		m->name = name;
-		m->next = NULL;
-		*b->last = m;
-		b->last = &m->next;
 	} else {
 		m = NULL;
 	}
@@ -1095,7 +1110,8 @@ decl(struct scope *s, struct func *f)
 					error(&tok.loc, "function '%s' redefined", name);
 				/* re-open scope from function declarator */
 				assert(funcscope);
-				s = funcscope;
+				s = reopenscope(funcscope);
+				funcarena = &bodyarena;
 				f = mkfunc(d, name, t, s);
 				stmt(f, s);
 				if (d->u.func.isnoreturn)
@@ -1105,6 +1121,9 @@ decl(struct scope *s, struct func *f)
 					emitfunc(f, d->linkage == LINKEXTERN);
 				s = delscope(s);
 				delfunc(f);
+				arenarelease(&bodyarena, &(struct arena){0});
+				funcarena = &tuarena;
+				typeclearcache(false);
 				d->defined = true;
 				return true;
 			} else if (funcscope) {
@@ -1124,20 +1143,30 @@ stringdecl(struct expr *expr)
 {
 	static struct map strings;
 	struct mapkey key;
-	void **entry;
 	struct decl *d;
+	struct arena *arena;
+	size_t size;
+	void *data;
 
 	if (!strings.len)
 		mapinit(&strings, 64);
 	assert(expr->kind == EXPRSTRING);
-	mapkey(&key, expr->u.string.data, expr->u.string.size);
-	entry = mapput(&strings, &key);
-	d = *entry;
+	size = expr->u.string.size * expr->type->base->size;
+	mapkey(&key, expr->u.string.data, size);
+	d = mapget(&strings, &key);
 	if (!d) {
-		d = mkdecl("string", DECLOBJECT, expr->type, QUALNONE, LINKNONE);
+		/* the decl outlives the function, so it can't be in funcarena */
+		arena = funcarena;
+		funcarena = &tuarena;
+		data = arenaalloc(&tuarena, size);
+		memcpy(data, expr->u.string.data, size);
+		/* the copy has the same contents, so keep the hash */
+		key.str = data;
+		d = mkdecl("string", DECLOBJECT, mkarraytype(expr->type->base, QUALNONE, expr->u.string.size), QUALNONE, LINKNONE);
 		d->value = mkglobal(d);
 		emitdata(d, mkinit(0, expr->type->size, (struct bitfield){0}, expr));
-		*entry = d;
+		*mapput(&strings, &key) = d;
+		funcarena = arena;
 	}
 	return d;
 }
@@ -54,6 +54,9 @@ struct input {
 static struct {
 	bool nostdlib;
 	bool verbose;
+	bool integratedcpp;
+	/* -M or -MM, which only the external preprocessor supports */
+	bool depsonly;
 } flags;
 static struct stageinfo stages[] = {
 	[PREPROCESS] = {.name = "preprocess"},
@@ -371,7 +374,7 @@ main(int argc, char *argv[])
 	enum stage last = LINK;
 	enum filetype filetype = 0;
 	char *arg, *end, *output = NULL,  *qbearch, *arch = NULL;
-	struct array inputs = {0}, *cmd;
+	struct array inputs = {0}, ppargs = {0}, *cmd;
 	struct input *input;
 	size_t i;
 
@@ -430,6 +433,13 @@ main(int argc, char *argv[])
 			arrayaddptr(&stages[LINK].cmd, arg);
 		} else if (strcmp(arg, "-emit-qbe") == 0) {
 			last = COMPILE;
+		} else if (strcmp(arg, "-integrated-cpp") == 0) {
+			flags.integratedcpp = true;
+		} else if (strncmp(arg, "-header-cache=", 14) == 0) {
+			arrayaddptr(&ppargs, "-C");
+			arrayaddptr(&ppargs, arg + 14);
+		} else if (strcmp(arg, "-linemarkers") == 0) {
+			arrayaddptr(&ppargs, "-l");
 		} else if (strcmp(arg, "-include") == 0 || strcmp(arg, "-idirafter") == 0 || strcmp(arg, "-isystem") == 0 || strcmp(arg, "-iquote") == 0) {
 			if (!--argc)
 				usage(NULL);
@@ -458,8 +468,11 @@ main(int argc, char *argv[])
 				last = ASSEMBLE;
 				break;
 			case 'D':
+				arg = nextarg(&argv);
 				arrayaddptr(&stages[PREPROCESS].cmd, "-D");
-				arrayaddptr(&stages[PREPROCESS].cmd, nextarg(&argv));
+				arrayaddptr(&stages[PREPROCESS].cmd, arg);
+				arrayaddptr(&ppargs, "-D");
+				arrayaddptr(&ppargs, arg);
 				break;
 			case 'E':
 				last = PREPROCESS;
@@ -468,8 +481,11 @@ main(int argc, char *argv[])
 				/* ignore */
 				break;
 			case 'I':
+				arg = nextarg(&argv);
 				arrayaddptr(&stages[PREPROCESS].cmd, "-I");
-				arrayaddptr(&stages[PREPROCESS].cmd, nextarg(&argv));
+				arrayaddptr(&stages[PREPROCESS].cmd, arg);
+				arrayaddptr(&ppargs, "-I");
+				arrayaddptr(&ppargs, arg);
 				break;
 			case 'm':
 				arrayaddptr(&stages[CODEGEN].cmd, "-m");
@@ -491,6 +507,7 @@ main(int argc, char *argv[])
 				if (strcmp(arg, "-M") == 0 || strcmp(arg, "-MM") == 0) {
 					arrayaddptr(&stages[PREPROCESS].cmd, arg);
 					last = PREPROCESS;
+					flags.depsonly = true;
 				} else if (strcmp(arg, "-MD") == 0 || strcmp(arg, "-MMD") == 0) {
 					arrayaddptr(&stages[PREPROCESS].cmd, arg);
 				} else if (strcmp(arg, "-MT") == 0 || strcmp(arg, "-MF") == 0) {
@@ -518,8 +535,11 @@ main(int argc, char *argv[])
 				arrayaddptr(&stages[LINK].cmd, "-s");
 				break;
 			case 'U':
+				arg = nextarg(&argv);
 				arrayaddptr(&stages[PREPROCESS].cmd, "-U");
-				arrayaddptr(&stages[PREPROCESS].cmd, nextarg(&argv));
+				arrayaddptr(&stages[PREPROCESS].cmd, arg);
+				arrayaddptr(&ppargs, "-U");
+				arrayaddptr(&ppargs, arg);
 				break;
 			case 'v':
 				flags.verbose = true;
@@ -569,6 +589,14 @@ main(int argc, char *argv[])
 
 	arrayaddptr(&stages[COMPILE].cmd, "-t");
 	arrayaddptr(&stages[COMPILE].cmd, arch);
+	/* the compiler preprocesses C sources itself with -integrated-cpp */
+	if (flags.integratedcpp && !flags.depsonly) {
+		arrayaddbuf(&stages[COMPILE].cmd, ppargs.val, ppargs.len);
+		if (last == PREPROCESS)
+			arrayaddptr(&stages[COMPILE].cmd, "-E");
+	} else {
+		flags.integratedcpp = false;
+	}
 
 	for (i = 0; i < LEN(stages); ++i)
 		stages[i].cmdbase = stages[i].cmd.len;
@@ -588,6 +616,15 @@ main(int argc, char *argv[])
 			continue;
 		/* only run up through the last stage */
 		input->stages &= (1 << last + 1) - 1;
+		if (flags.integratedcpp && input->filetype == C) {
+			input->stages &= ~(1<<PREPROCESS);
+			/* with -E, the compiler writes the preprocessed source to stdout */
+			if (last == PREPROCESS) {
+				input->stages = 1<<COMPILE;
+				buildobj(input, output ? output : "-");
+				continue;
+			}
+		}
 		buildobj(input, output);
 	}
 	if (last == LINK) {
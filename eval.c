@@ -152,7 +152,8 @@ eval(struct expr *expr)
 		break;
 	case EXPRCAST:
 		l = eval(expr->base);
-		if (l->kind == EXPRCONST) {
+		/* a cast to void has no value to fold */
+		if (l->kind == EXPRCONST && t != &typevoid) {
 			expr->kind = EXPRCONST;
 			if (l->type->prop & PROPINT && t->prop & PROPFLOAT) {
 				if (l->type->u.basic.issigned)
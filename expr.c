@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,69 +10,80 @@
 #include "utf.h"
 #include "cc.h"
 
+#define EXPRSIZE(m) (offsetof(struct expr, u) + sizeof(((struct expr *)0)->u.m))
+
+/*
+Size of the node for each kind of expression. Unary, cast and
+identifier expressions may be folded into constants by eval,
+so their nodes must have room for one.
+*/
+static const struct {
+	const char *name;
+	size_t size;
+} exprkinds[] = {
+	[EXPRIDENT]    = {"identifier",    EXPRSIZE(ident)},
+	[EXPRCONST]    = {"constant",      EXPRSIZE(constant)},
+	[EXPRSTRING]   = {"string",        EXPRSIZE(string)},
+	[EXPRCALL]     = {"call",          EXPRSIZE(call)},
+	[EXPRBITFIELD] = {"bit-field",     EXPRSIZE(bitfield)},
+	[EXPRINCDEC]   = {"increment",     EXPRSIZE(incdec)},
+	[EXPRCOMPOUND] = {"compound",      EXPRSIZE(compound)},
+	[EXPRUNARY]    = {"unary",         EXPRSIZE(constant)},
+	[EXPRCAST]     = {"cast",          EXPRSIZE(cast)},
+	[EXPRBINARY]   = {"binary",        EXPRSIZE(binary)},
+	[EXPRCOND]     = {"conditional",   EXPRSIZE(cond)},
+	[EXPRASSIGN]   = {"assignment",    EXPRSIZE(assign)},
+	[EXPRCOMMA]    = {"comma",         EXPRSIZE(comma)},
+	[EXPRBUILTIN]  = {"builtin",       EXPRSIZE(builtin)},
+	[EXPRTEMP]     = {"temporary",     EXPRSIZE(temp)},
+	[EXPRSIZEOF]   = {"sizeof",        EXPRSIZE(szof)},
+};
+/* eval folds these kinds in place, into constants or identifiers */
+typedef char exprfoldcheck[
+	EXPRSIZE(ident) >= EXPRSIZE(constant)
+	&& EXPRSIZE(cast) >= EXPRSIZE(constant)
+	&& EXPRSIZE(binary) >= EXPRSIZE(constant)
+	&& EXPRSIZE(compound) >= EXPRSIZE(ident)
+	&& EXPRSIZE(string) >= EXPRSIZE(ident) ? 1 : -1];
+/* number of nodes of each kind, reported with exprstats */
+static unsigned long exprcount[LEN(exprkinds)];
+
 static struct expr *
 mkexpr(enum exprkind k, struct type *t, struct expr *b)
 {
 	struct expr *e;
 
-	e = xmalloc(sizeof(*e));
+	assert(k < LEN(exprkinds));
+	e = arenaalloc(funcarena, exprkinds[k].size);
+	++exprcount[k];
 	e->qual = QUALNONE;
 	e->type = t;
 	e->lvalue = false;
 	e->decayed = false;
 	e->kind = k;
 	e->base = b;
-	e->next = NULL;
-	e->toeval = NULL;
 
 	return e;
 }
 
 void
-delexpr(struct expr *e)
+exprstats(FILE *f)
 {
-	struct expr *sub;
-
-	switch (e->kind) {
-	case EXPRCALL:
-		delexpr(e->base);
-		while (sub = e->u.call.args) {
-			e->u.call.args = sub->next;
-			delexpr(sub);
-		}
-		break;
-	case EXPRBITFIELD:
-	case EXPRINCDEC:
-	case EXPRUNARY:
-	case EXPRCAST:
-		delexpr(e->base);
-		break;
-	case EXPRBINARY:
-		delexpr(e->u.binary.l);
-		delexpr(e->u.binary.r);
-		break;
-	case EXPRCOND:
-		delexpr(e->base);
-		delexpr(e->u.cond.t);
-		delexpr(e->u.cond.f);
-		break;
-	/*
-	XXX: compound assignment causes some reuse of expressions,
-	so we can't free them without risk of a double-free
-
-	case EXPRASSIGN:
-		delexpr(e->assign.l);
-		delexpr(e->assign.r);
-		break;
-	*/
-	case EXPRCOMMA:
-		while (sub = e->base) {
-			e->base = sub->next;
-			delexpr(sub);
-		}
-		break;
+	unsigned long total, full;
+	size_t i;
+
+	/* max-size bytes are those used if every node had the size of the largest kind */
+	total = 0;
+	full = 0;
+	fprintf(f, "expression nodes:   count      bytes   max-size bytes\n");
+	for (i = 0; i < LEN(exprkinds); ++i) {
+		if (exprcount[i] == 0)
+			continue;
+		fprintf(f, "%16s %8lu %10lu %16lu\n", exprkinds[i].name, exprcount[i], exprcount[i] * exprkinds[i].size, exprcount[i] * sizeof(struct expr));
+		total += exprcount[i] * exprkinds[i].size;
+		full += exprcount[i] * sizeof(struct expr);
 	}
-	free(e);
+	fprintf(f, "%16s %8s %10lu %16lu\n", "total", "", total, full);
 }
 
 static struct expr *
@@ -126,11 +138,8 @@ mkunaryexpr(enum tokenkind op, struct expr *base)
 
 	switch (op) {
 	case TBAND:
-		if (base->decayed) {
-			expr = base;
+		if (base->decayed)
 			base = base->base;
-			free(expr);
-		}
 		/*
 		Allow struct and union types even if they are not lvalues,
 		since we take their address when compiling member access.
@@ -170,12 +179,23 @@ bitfieldwidth(struct expr *e)
 	return e->type->size * 8 - e->u.bitfield.bits.before - e->u.bitfield.bits.after;
 }
 
+static struct expr *
+mkcastexpr(struct type *t, struct expr *b)
+{
+	struct expr *e;
+
+	e = mkexpr(EXPRCAST, t, b);
+	e->u.cast.toeval = NULL;
+
+	return e;
+}
+
 static struct expr *
 exprconvert(struct expr *e, struct type *t)
 {
 	if (typecompatible(e->type, t))
 		return e;
-	return mkexpr(EXPRCAST, t, e);
+	return mkcastexpr(t, e);
 }
 
 static bool
@@ -474,6 +494,29 @@ decodechar(const char *src, uint_least32_t *chr, bool *hexoct, const char *desc,
 	return s - (const unsigned char *)src;
 }
 
+/* decode a character constant, returning its type */
+struct type *
+charconstvalue(const char *src, unsigned long long *val, struct location *loc)
+{
+	struct type *t;
+	uint_least32_t chr;
+
+	switch (*src) {
+	case 'L': ++src; t = targ->typewchar; break;
+	case 'u': ++src; t = *src == '8' ? ++src, &typeuchar : &typeushort; break;
+	case 'U': ++src; t = &typeuint; break;
+	default: t = &typeint;
+	}
+	assert(*src == '\'');
+	++src;
+	src += decodechar(src, &chr, NULL, "character constant", loc);
+	if (*src != '\'')
+		error(loc, "character constant contains more than one character: %c", *src);
+	*val = chr;
+
+	return t;
+}
+
 static size_t
 encodechar8(void *dst, uint_least32_t chr, bool hexoct)
 {
@@ -566,7 +609,7 @@ stringconcat(struct stringlit *str, bool forceutf8)
 	default:
 		assert(0);
 	}
-	buf = xreallocarray(NULL, len, width);
+	buf = arenaalloc(funcarena, len * width);
 	str->data = buf;
 	dst = buf;
 	arrayforeach(&parts, p) {
@@ -594,7 +637,6 @@ generic(struct scope *s)
 	e = assignexpr(s);
 	expect(TCOMMA, "after generic selector expression");
 	want = e->type;
-	delexpr(e);
 	do {
 		if (consume(TDEFAULT)) {
 			if (def)
@@ -618,8 +660,6 @@ generic(struct scope *s)
 				if (match)
 					error(&tok.loc, "generic selector matches multiple associations");
 				match = e;
-			} else {
-				delexpr(e);
 			}
 		}
 	} while (consume(TCOMMA));
@@ -628,8 +668,6 @@ generic(struct scope *s)
 		if (!def)
 			error(&tok.loc, "generic selector matches no associations and no default was specified");
 		match = def;
-	} else if (def) {
-		delexpr(def);
 	}
 	return match;
 }
@@ -642,7 +680,7 @@ primaryexpr(struct scope *s)
 	struct decl *d;
 	struct type *t;
 	char *src, *end;
-	uint_least32_t chr;
+	unsigned long long chr;
 	int base;
 
 	switch (tok.kind) {
@@ -666,19 +704,8 @@ primaryexpr(struct scope *s)
 		e = decay(e);
 		break;
 	case TCHARCONST:
-		src = tok.lit;
-		switch (*src) {
-		case 'L': ++src; t = targ->typewchar; break;
-		case 'u': ++src; t = *src == '8' ? ++src, &typeuchar : &typeushort; break;
-		case 'U': ++src; t = &typeuint; break;
-		default: t = &typeint;
-		}
-		assert(*src == '\'');
-		++src;
-		src += decodechar(src, &chr, NULL, "character constant", &tok.loc);
+		t = charconstvalue(tok.lit, &chr, &tok.loc);
 		e = mkconstexpr(t, chr);
-		if (*src != '\'')
-			error(&tok.loc, "character constant contains more than one character: %c", *src);
 		next();
 		break;
 	case TNUMBER:
@@ -771,7 +798,6 @@ designator(struct scope *s, struct type *t, unsigned long long *offset)
 			m = typemember(t, name, offset);
 			if (!m)
 				error(&tok.loc, "%s has no member named '%s'", t->kind == TYPEUNION ? "union" : "struct", name);
-			free(name);
 			t = m->type;
 			break;
 		default:
@@ -783,8 +809,9 @@ designator(struct scope *s, struct type *t, unsigned long long *offset)
 static struct expr *
 builtinfunc(struct scope *s, enum builtinkind kind)
 {
-	struct expr *e, *toeval;
+	struct expr *e;
 	struct type *t;
+	enum typequal tq;
 	struct member *m;
 	char *name;
 	unsigned long long offset;
@@ -803,7 +830,7 @@ builtinfunc(struct scope *s, enum builtinkind kind)
 		/* TODO: check that the expression and the expected value have type 'long' */
 		e = assignexpr(s);
 		expect(TCOMMA, "after expression");
-		delexpr(assignexpr(s));
+		assignexpr(s);
 		break;
 	case BUILTININFF:
 		e = mkexpr(EXPRCONST, &typefloat, NULL);
@@ -830,7 +857,6 @@ builtinfunc(struct scope *s, enum builtinkind kind)
 			error(&tok.loc, "struct/union has no member named '%s'", name);
 		designator(s, m->type, &offset);
 		e = mkconstexpr(&typeulong, offset);
-		free(name);
 		break;
 	case BUILTINTYPESCOMPATIBLEP:
 		t = typename(s, NULL, NULL);
@@ -849,8 +875,8 @@ builtinfunc(struct scope *s, enum builtinkind kind)
 		if (typeadjvalist == targ->typevalist)
 			e->base = mkunaryexpr(TBAND, e->base);
 		expect(TCOMMA, "after va_list");
-		e->type = typename(s, &e->qual, &toeval);
-		e->toeval = toeval;
+		e->type = typename(s, &tq, &e->u.builtin.toeval);
+		e->qual = tq;
 		break;
 	case BUILTINVACOPY:
 		e = mkexpr(EXPRASSIGN, &typevoid, NULL);
@@ -870,7 +896,7 @@ builtinfunc(struct scope *s, enum builtinkind kind)
 		e = assignexpr(s);
 		if (!typesame(e->type, typeadjvalist))
 			error(&tok.loc, "va_end argument must have type va_list");
-		e = mkexpr(EXPRCAST, &typevoid, e);
+		e = mkcastexpr(&typevoid, e);
 		break;
 	case BUILTINVASTART:
 		e = mkexpr(EXPRBUILTIN, &typevoid, assignexpr(s));
@@ -880,7 +906,7 @@ builtinfunc(struct scope *s, enum builtinkind kind)
 		if (typeadjvalist == targ->typevalist)
 			e->base = mkunaryexpr(TBAND, e->base);
 		if (consume(TCOMMA))
-			delexpr(assignexpr(s));
+			assignexpr(s);
 		break;
 	default:
 		fatal("internal error; unknown builtin");
@@ -907,9 +933,12 @@ mkincdecexpr(enum tokenkind op, struct expr *base, bool post)
 static struct expr *
 postfixexpr(struct scope *s, struct expr *r)
 {
-	struct expr *e, *arr, *idx, *tmp, **end;
+	/* arguments of the calls being parsed, innermost last */
+	static struct array args;
+	struct expr *e, *arr, *idx, *tmp, *arg;
 	struct type *t;
-	struct decl *p;
+	struct decl **p;
+	size_t argstart;
 	struct member *m;
 	unsigned long long offset;
 	enum typequal tq;
@@ -952,24 +981,27 @@ postfixexpr(struct scope *s, struct expr *r)
 			e->u.call.args = NULL;
 			e->u.call.nargs = 0;
 			p = t->u.func.params;
-			end = &e->u.call.args;
+			argstart = args.len;
 			while (tok.kind != TRPAREN) {
-				if (e->u.call.args)
+				if (e->u.call.nargs > 0)
 					expect(TCOMMA, "or ')' after function call argument");
-				if (!p && !t->u.func.isvararg)
+				if (e->u.call.nargs == t->u.func.nparam && !t->u.func.isvararg)
 					error(&tok.loc, "too many arguments for function call");
-				*end = assignexpr(s);
-				if (t->u.func.isvararg && !p)
-					*end = exprpromote(*end);
+				arg = assignexpr(s);
+				if (e->u.call.nargs >= t->u.func.nparam)
+					arg = exprpromote(arg);
 				else
-					*end = exprassign(*end, p->type);
-				end = &(*end)->next;
+					arg = exprassign(arg, p[e->u.call.nargs]->type);
+				arrayaddptr(&args, arg);
 				++e->u.call.nargs;
-				if (p)
-					p = p->next;
 			}
-			if (p && !t->u.func.isvararg)
+			if (e->u.call.nargs < t->u.func.nparam && !t->u.func.isvararg)
 				error(&tok.loc, "not enough arguments for function call");
+			if (e->u.call.nargs > 0) {
+				e->u.call.args = arenaalloc(funcarena, args.len - argstart);
+				memcpy(e->u.call.args, (char *)args.val + argstart, args.len - argstart);
+				args.len = argstart;
+			}
 			e = decay(e);
 			next();
 			break;
@@ -1142,7 +1174,7 @@ castexpr(struct scope *s)
 		expect(TRPAREN, "after type name");
 		if (tok.kind == TLBRACE) {
 			e = mkexpr(EXPRCOMPOUND, t, NULL);
-			e->toeval = toeval;
+			e->u.compound.toeval = toeval;
 			e->qual = tq;
 			e->lvalue = true;
 			d = mkdecl(NULL, DECLOBJECT, t, tq, LINKNONE);
@@ -1154,8 +1186,8 @@ castexpr(struct scope *s)
 		}
 		if (t != &typevoid && !(t->prop & PROPSCALAR))
 			error(&tok.loc, "cast type must be scalar");
-		e = mkexpr(EXPRCAST, t, NULL);
-		e->toeval = toeval;
+		e = mkcastexpr(t, NULL);
+		e->u.cast.toeval = toeval;
 		*end = e;
 		end = &e->base;
 		ct = t;
@@ -1231,6 +1263,8 @@ condexpr(struct scope *s)
 	expect(TCOLON, "in conditional expression");
 	r = condexpr(s);
 
+	l = eval(l);
+	r = eval(r);
 	lt = l->type;
 	rt = r->type;
 	if (lt == rt) {
@@ -1240,8 +1274,6 @@ condexpr(struct scope *s)
 	} else if (lt == &typevoid && rt == &typevoid) {
 		t = &typevoid;
 	} else {
-		l = eval(l);
-		r = eval(r);
 		if (nullpointer(l) && rt->kind == TYPEPOINTER) {
 			t = rt;
 		} else if (nullpointer(r) && lt->kind == TYPEPOINTER) {
@@ -1297,6 +1329,17 @@ mkassignexpr(struct expr *l, struct expr *r)
 	return e;
 }
 
+static struct expr *
+mkcommaexpr(struct expr *l, struct expr *r)
+{
+	struct expr *e;
+
+	e = mkexpr(EXPRCOMMA, r->type, NULL);
+	e->u.comma.l = l;
+	e->u.comma.r = r;
+	return e;
+}
+
 struct expr *
 assignexpr(struct scope *s)
 {
@@ -1344,25 +1387,16 @@ assignexpr(struct scope *s)
 		l = bit;
 	}
 	r = mkbinaryexpr(&tok.loc, op, l, r);
-	e->next = mkassignexpr(l, r);
-	return mkexpr(EXPRCOMMA, l->type, e);
+	return mkcommaexpr(e, mkassignexpr(l, r));
 }
 
 struct expr *
 expr(struct scope *s)
 {
-	struct expr *r, *e, **end;
+	struct expr *e;
 
-	end = &r;
-	for (;;) {
-		e = assignexpr(s);
-		*end = e;
-		end = &e->next;
-		if (tok.kind != TCOMMA)
-			break;
-		next();
-	}
-	if (!r->next)
-		return r;
-	return mkexpr(EXPRCOMMA, e->type, r);
+	e = assignexpr(s);
+	while (consume(TCOMMA))
+		e = mkcommaexpr(e, assignexpr(s));
+	return e;
 }
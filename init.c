@@ -27,7 +27,7 @@ mkinit(unsigned long long start, unsigned long long end, struct bitfield bits, s
 {
 	struct init *init;
 
-	init = xmalloc(sizeof(*init));
+	init = arenaalloc(funcarena, sizeof(*init));
 	init->start = start;
 	init->end = end;
 	init->expr = expr;
@@ -78,21 +78,16 @@ findmember(struct initparser *p, char *name)
 {
 	struct member *m;
 
-	for (m = p->sub->type->u.structunion.members; m; m = m->next) {
-		if (m->name) {
-			if (strcmp(m->name, name) == 0) {
-				p->sub->u.mem = m;
-				subobj(p, m->type, m->offset);
-				return true;
-			}
-		} else {
-			subobj(p, m->type, m->offset);
-			if (findmember(p, name))
-				return true;
-			--p->sub;
-		}
+	m = typedirectmember(p->sub->type, name);
+	if (!m)
+		return false;
+	if (m->name) {
+		p->sub->u.mem = m;
+		subobj(p, m->type, m->offset);
+		return true;
 	}
-	return false;
+	subobj(p, m->type, m->offset);
+	return findmember(p, name);
 }
 
 static void
@@ -126,7 +121,6 @@ designator(struct scope *s, struct initparser *p)
 			name = expect(TIDENT, "for member designator");
 			if (!findmember(p, name))
 				error(&tok.loc, "%s has no member named '%s'", t->kind == TYPEUNION ? "union" : "struct", name);
-			free(name);
 			break;
 		default:
 			expect(TASSIGN, "after designator");
@@ -178,8 +172,7 @@ advance(struct initparser *p)
 			subobj(p, t->base, p->sub->u.idx);
 			return;
 		case TYPESTRUCT:
-			p->sub->u.mem = p->sub->u.mem->next;
-			if (p->sub->u.mem) {
+			if (++p->sub->u.mem != t->u.structunion.members + t->u.structunion.nmember) {
 				subobj(p, p->sub->u.mem->type, p->sub->u.mem->offset);
 				return;
 			}
@@ -268,8 +261,10 @@ parseinit(struct scope *s, struct type *t)
 			bits = (struct bitfield){0};
 		initadd(&p, mkinit(p.sub->offset, p.sub->offset + p.sub->type->size, bits, expr));
 		for (;;) {
-			if (p.sub->type->incomplete)
+			if (p.sub->type->incomplete) {
 				p.sub->type->incomplete = false;
+				typeclearcache(true);
+			}
 		next:
 			if (!p.cur)
 				return p.init;
@@ -1,6 +1,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "util.h"
 #include "arg.h"
 #include "cc.h"
@@ -16,13 +17,46 @@ int
 main(int argc, char *argv[])
 {
 	bool pponly = false;
-	char *output = NULL, *target = NULL;
+	char *output = NULL, *target = NULL, *arg, *val;
+	struct array defs = {0};
 
 	argv0 = progname(argv[0], "cproc-qbe");
 	ARGBEGIN {
+	case 'D':
+		arg = EARGF(usage());
+		val = strchr(arg, '=');
+		arrayaddbuf(&defs, "#define ", 8);
+		if (val) {
+			arrayaddbuf(&defs, arg, val - arg);
+			arrayaddbuf(&defs, " ", 1);
+			arrayaddbuf(&defs, val + 1, strlen(val + 1));
+		} else {
+			arrayaddbuf(&defs, arg, strlen(arg));
+			arrayaddbuf(&defs, " 1", 2);
+		}
+		arrayaddbuf(&defs, "\n", 1);
+		break;
+	case 'U':
+		arg = EARGF(usage());
+		arrayaddbuf(&defs, "#undef ", 7);
+		arrayaddbuf(&defs, arg, strlen(arg));
+		arrayaddbuf(&defs, "\n", 1);
+		break;
+	case 'C':
+		ppcachedir(EARGF(usage()));
+		break;
 	case 'E':
 		pponly = true;
 		break;
+	case 'I':
+		ppincludedir(EARGF(usage()));
+		break;
+	case 'l':
+		ppflags |= PPLINEMARKERS;
+		break;
+	case 's':
+		ppflags |= PPSTATS;
+		break;
 	case 't':
 		target = EARGF(usage());
 		break;
@@ -45,6 +79,11 @@ main(int argc, char *argv[])
 	} else {
 		scanfrom("<stdin>", stdin);
 	}
+	if (defs.len > 0) {
+		/* leave room for the scanner to terminate the last token */
+		arrayaddbuf(&defs, "", 1);
+		scanbuffer("<command-line>", defs.val, defs.len - 1);
+	}
 
 	ppinit();
 	if (pponly) {
@@ -53,6 +92,7 @@ main(int argc, char *argv[])
 			tokenprint(&tok);
 			next();
 		}
+		tokenflush();
 	} else {
 		scopeinit();
 		while (tok.kind != TEOF) {
@@ -68,5 +108,12 @@ main(int argc, char *argv[])
 	fflush(stdout);
 	if (ferror(stdout))
 		fatal("write failed");
+	if (ppflags & PPSTATS) {
+		ppstats(stderr);
+		if (!pponly) {
+			typestats(stderr);
+			exprstats(stderr);
+		}
+	}
 	return 0;
 }
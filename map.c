@@ -1,19 +1,58 @@
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include "util.h"
 
+static uint_least64_t
+read64(const unsigned char *p)
+{
+	uint_least64_t w = 0;
+
+	memcpy(&w, p, 8);
+	return w;
+}
+
+static uint_least32_t
+read32(const unsigned char *p)
+{
+	uint_least32_t w = 0;
+
+	memcpy(&w, p, 4);
+	return w;
+}
+
 static unsigned long
 hash(const void *ptr, size_t len)
 {
-	unsigned long h;
-	const unsigned char *pos, *end;
+	static const uint_least64_t m = 0xc6a4a7935bd1e995;
+	const unsigned char *str, *pos;
+	uint_least64_t h, w;
+	size_t n;
 
-	/* FNV-1a */
-	h = 0x811c9dc5;
-	for (pos = ptr, end = pos + len; pos != end; ++pos)
-		h = (h ^ *pos) * 0x1000193;
+	/* based on MurmurHash64A, reading the key 8 bytes at a time */
+	str = ptr;
+	pos = str;
+	h = len * m;
+	for (n = len; n > 8; n -= 8, pos += 8) {
+		w = read64(pos) * m;
+		w ^= w >> 47;
+		h = (h ^ w * m) * m;
+	}
+	/* the last 1 to 8 bytes, possibly overlapping the previous word */
+	if (len >= 8)
+		w = read64(str + len - 8);
+	else if (len >= 4)
+		w = (uint_least64_t)read32(pos) << 32 | read32(pos + n - 4);
+	else if (len > 0)
+		w = pos[0] << 16 | pos[n / 2] << 8 | pos[n - 1];
+	else
+		w = 0;
+	h = (h ^ w) * m;
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
 	return h;
 }
 
@@ -25,18 +64,32 @@ mapkey(struct mapkey *k, const void *s, size_t n)
 	k->hash = hash(s, n);
 }
 
+/*
+The map uses Robin Hood hashing. Each slot has a control word
+containing the probe distance of its entry plus one (or 0 if the slot
+is empty) in the upper bits, and a fingerprint of the hash in the low
+byte, so most probes only need to look at the control array. Entries
+are kept ordered by probe distance, so a lookup can stop as soon as it
+reaches an entry closer to its home slot than the key would be.
+*/
+
+#define CTRL(dist, hash) ((dist) + 1 << 8 | (hash) >> 24 & 0xff)
+
+static void
+alloc(struct map *h, size_t cap)
+{
+	h->cap = cap;
+	h->ctrl = xreallocarray(NULL, cap, sizeof(h->ctrl[0]));
+	h->slots = xreallocarray(NULL, cap, sizeof(h->slots[0]));
+	memset(h->ctrl, 0, cap * sizeof(h->ctrl[0]));
+}
+
 void
 mapinit(struct map *h, size_t cap)
 {
-	size_t i;
-
 	assert(!(cap & cap - 1));
 	h->len = 0;
-	h->cap = cap;
-	h->keys = xreallocarray(NULL, cap, sizeof(h->keys[0]));
-	h->vals = xreallocarray(NULL, cap, sizeof(h->vals[0]));
-	for (i = 0; i < cap; ++i)
-		h->keys[i].str = NULL;
+	alloc(h, cap);
 }
 
 void
@@ -46,12 +99,12 @@ mapfree(struct map *h, void del(void *))
 
 	if (del) {
 		for (i = 0; i < h->cap; ++i) {
-			if (h->keys[i].str)
-				del(h->vals[i]);
+			if (h->ctrl[i])
+				del(h->slots[i].val);
 		}
 	}
-	free(h->keys);
-	free(h->vals);
+	free(h->ctrl);
+	free(h->slots);
 }
 
 static bool
@@ -59,54 +112,92 @@ keyequal(struct mapkey *k1, struct mapkey *k2)
 {
 	if (k1->hash != k2->hash || k1->len != k2->len)
 		return false;
-	return memcmp(k1->str, k2->str, k1->len) == 0;
+	return k1->str == k2->str || memcmp(k1->str, k2->str, k1->len) == 0;
 }
 
+/* index of the slot containing k, or -1 */
 static size_t
 keyindex(struct map *h, struct mapkey *k)
 {
 	size_t i;
+	unsigned c;
 
 	i = k->hash & h->cap - 1;
-	while (h->keys[i].str && !keyequal(&h->keys[i], k))
+	for (c = CTRL(0, k->hash); c >> 8 <= h->ctrl[i] >> 8; c += 1 << 8) {
+		if (h->ctrl[i] == c && keyequal(&h->slots[i].key, k))
+			return i;
 		i = i + 1 & h->cap - 1;
-	return i;
+	}
+	return -1;
 }
 
-void **
-mapput(struct map *h, struct mapkey *k)
+static size_t place(struct map *, struct mapkey *, void *);
+
+static void
+resize(struct map *h, size_t cap)
+{
+	unsigned *oldctrl;
+	struct mapslot *oldslots;
+	size_t i, oldcap;
+
+	oldctrl = h->ctrl;
+	oldslots = h->slots;
+	oldcap = h->cap;
+	alloc(h, cap);
+	for (i = 0; i < oldcap; ++i) {
+		if (oldctrl[i])
+			place(h, &oldslots[i].key, oldslots[i].val);
+	}
+	free(oldctrl);
+	free(oldslots);
+}
+
+/* insert a key not yet in the map, and return the index of its slot */
+static size_t
+place(struct map *h, struct mapkey *k, void *v)
 {
-	struct mapkey *oldkeys;
-	void **oldvals;
-	size_t i, j, oldcap;
-
-	if (h->cap / 2 < h->len) {
-		oldkeys = h->keys;
-		oldvals = h->vals;
-		oldcap = h->cap;
-		h->cap *= 2;
-		h->keys = xreallocarray(NULL, h->cap, sizeof(h->keys[0]));
-		h->vals = xreallocarray(NULL, h->cap, sizeof(h->vals[0]));
-		for (i = 0; i < h->cap; ++i)
-			h->keys[i].str = NULL;
-		for (i = 0; i < oldcap; ++i) {
-			if (oldkeys[i].str) {
-				j = keyindex(h, &oldkeys[i]);
-				h->keys[j] = oldkeys[i];
-				h->vals[j] = oldvals[i];
-			}
+	struct mapslot slot, tmpslot;
+	unsigned c, tmpc;
+	size_t i, pos;
+
+	slot.key = *k;
+	slot.val = v;
+	pos = -1;
+	i = k->hash & h->cap - 1;
+	for (c = CTRL(0, k->hash); h->ctrl[i]; c += 1 << 8) {
+		/* take the slot from an entry closer to its home slot */
+		if (h->ctrl[i] < c) {
+			tmpc = h->ctrl[i], h->ctrl[i] = c, c = tmpc;
+			tmpslot = h->slots[i], h->slots[i] = slot, slot = tmpslot;
+			if (pos == -1)
+				pos = i;
 		}
-		free(oldkeys);
-		free(oldvals);
+		if (c >> 8 == 0xffffff) {
+			/* probe distance does not fit, so grow the map and start over */
+			resize(h, h->cap * 2);
+			i = place(h, &slot.key, slot.val);
+			return pos == -1 ? i : keyindex(h, k);
+		}
+		i = i + 1 & h->cap - 1;
 	}
+	h->ctrl[i] = c;
+	h->slots[i] = slot;
+	return pos == -1 ? i : pos;
+}
+
+void **
+mapput(struct map *h, struct mapkey *k)
+{
+	size_t i;
+
 	i = keyindex(h, k);
-	if (!h->keys[i].str) {
-		h->keys[i] = *k;
-		h->vals[i] = NULL;
+	if (i == -1) {
+		if (h->len >= h->cap - h->cap / 4)
+			resize(h, h->cap * 2);
+		i = place(h, k, NULL);
 		++h->len;
 	}
-
-	return &h->vals[i];
+	return &h->slots[i].val;
 }
 
 void *
@@ -115,5 +206,43 @@ mapget(struct map *h, struct mapkey *k)
 	size_t i;
 
 	i = keyindex(h, k);
-	return h->keys[i].str ? h->vals[i] : NULL;
+	return i == -1 ? NULL : h->slots[i].val;
+}
+
+/* remove a key from the map, and return its value */
+void *
+mapdel(struct map *h, struct mapkey *k)
+{
+	size_t i, j;
+	void *val;
+
+	i = keyindex(h, k);
+	if (i == -1)
+		return NULL;
+	val = h->slots[i].val;
+	/* shift back the following entries until one is in its home slot */
+	for (;;) {
+		j = i + 1 & h->cap - 1;
+		if (h->ctrl[j] >> 8 <= 1)
+			break;
+		h->ctrl[i] = h->ctrl[j] - (1 << 8);
+		h->slots[i] = h->slots[j];
+		i = j;
+	}
+	h->ctrl[i] = 0;
+	--h->len;
+	return val;
+}
+
+/* reduce the capacity of the map to the smallest that fits its entries */
+void
+mapshrink(struct map *h)
+{
+	size_t cap;
+
+	cap = h->cap;
+	while (cap > 1 && h->len < cap / 2 - cap / 8)
+		cap /= 2;
+	if (cap != h->cap)
+		resize(h, cap);
 }
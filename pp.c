@@ -1,9 +1,20 @@
+#define _XOPEN_SOURCE 700
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "util.h"
 #include "cc.h"
 
@@ -13,12 +24,16 @@ struct macroparam {
 		PARAMTOK = 1<<0,  /* the parameter is used normally */
 		PARAMSTR = 1<<1,  /* the parameter is used with the '#' operator */
 		PARAMVAR = 1<<2,  /* the parameter is __VA_ARGS__ */
+		PARAMRAW = 1<<3,  /* the parameter is an operand of '##' */
 	} flags;
 };
 
 struct macroarg {
 	struct token *token;
 	size_t ntoken;
+	/* argument tokens before macro expansion */
+	struct token *raw;
+	size_t nraw;
 	/* stringized argument */
 	struct token str;
 };
@@ -31,6 +46,8 @@ struct macro {
 	char *name;
 	/* whether or not this macro is ineligible for expansion */
 	bool hide;
+	/* whether or not the replacement list contains '##' */
+	bool paste;
 	/* parameters of function-like macro */
 	struct macroparam *param;
 	size_t nparam;
@@ -39,28 +56,213 @@ struct macro {
 	/* replacement list */
 	struct token *token;
 	size_t ntoken;
+	/* replacement list of the current expansion after concatenation */
+	struct token *pasted;
+	size_t npasted;
+	/* number of times the macro was expanded */
+	unsigned long nexpand;
 };
 
 struct frame {
 	struct token *token;
 	size_t ntoken;
 	struct macro *macro;
+	/* position of the expansion in argmarks, or 0 */
+	size_t mark;
+};
+
+/* state of the argument arena before an expansion allocated from it */
+struct argmark {
+	struct arena arena;
+	bool done;
+};
+
+/* buffers for reading the arguments of a macro invocation */
+struct argbuf {
+	struct array arg, tok, raw, str;
+};
+
+/* multiple-include optimization state of a file */
+struct guard {
+	char *path;  /* canonical path of the file */
+	/* the file contained #pragma once */
+	bool once;
+	/* macro that must be undefined for the file to have any effect */
+	char *macro;
+};
+
+struct file {
+	/* depth of the file in the input stack */
+	size_t depth;
+	/* number of open conditionals when the file was included */
+	size_t nconds;
+};
+
+struct cond {
+	/* whether or not a group of this conditional was included */
+	bool done;
+	/* whether or not the #else directive was seen */
+	bool sawelse;
+	struct location loc;
+	/* file whose contents may be guarded by this conditional */
+	struct guard *guard;
+	char *macro;
+};
+
+/* value of an expression in #if */
+struct condval {
+	unsigned long long v;
+	bool u;  /* whether or not the value is unsigned */
 };
 
 enum ppflags ppflags;
 
 static struct array ctx;
-static struct map macros;
 /* number of macros currently undergoing expansion */
 static size_t macrodepth;
+/*
+Arguments of macro invocations are allocated from an arena, which is
+released when the expansion is done. Expansions usually end in the
+reverse order they started, but not always (a macro may expand to the
+closing parenthesis of an invocation), so an expansion's memory is only
+reclaimed once all those that allocated after it have ended as well.
+*/
+static struct arena argarena;
+static struct array argmarks;
+/* argument buffers, one for each level of nested invocations being read */
+static struct array argbufs;
+static size_t argdepth;
+/* literals created by '#' and '##', which may outlive their expansion */
+static struct arena litarena;
+
+/* statistics reported with ppstats */
+static struct {
+	clock_t start, dirtime;
+	/* tokens read from files, replayed from the header cache, in skipped groups, and output */
+	unsigned long tokens, replayed, skipped, output;
+	unsigned long directives;
+	unsigned long objexpand, funcexpand;
+	/* maximum number of context frames, and of nested expansions */
+	size_t maxctx, maxdepth;
+	size_t litbytes;
+	unsigned long cachehits, cachemisses;
+	/* every macro that was defined */
+	struct array macros;
+} stats;
+/* stack of conditional directives */
+static struct array conds;
+/* stack of included files being scanned */
+static struct array files;
+static struct array includedirs;
+/* guards of included files, by canonical path */
+static struct map guards;
+/* guard of the file just included, until its first token */
+static struct guard *newfile;
+static char *vaargs, *defined;
+/* directory of the header cache, if enabled */
+static char *cachedir, *cachecwd;
+/* order-independent hash of all macro definitions */
+static unsigned long long macrodigest;
+
+static const struct {
+	const char *name;
+	int value;
+} keywords[] = {
+	{"_Alignas",       TALIGNAS},
+	{"_Alignof",       TALIGNOF},
+	{"_Atomic",        T_ATOMIC},
+	{"_Bool",          TBOOL},
+	{"_Complex",       T_COMPLEX},
+	{"_Decimal128",    T_DECIMAL128},
+	{"_Decimal32",     T_DECIMAL32},
+	{"_Decimal64",     T_DECIMAL64},
+	{"_Generic",       T_GENERIC},
+	{"_Imaginary",     T_IMAGINARY},
+	{"_Noreturn",      T_NORETURN},
+	{"_Static_assert", TSTATIC_ASSERT},
+	{"_Thread_local",  TTHREAD_LOCAL},
+	{"__alignof__",    TALIGNOF},
+	{"__asm",          T__ASM__},
+	{"__asm__",        T__ASM__},
+	{"__attribute__",  T__ATTRIBUTE__},
+	{"__inline",       TINLINE},
+	{"__inline__",     TINLINE},
+	{"__signed",       TSIGNED},
+	{"__signed__",     TSIGNED},
+	{"__thread",       TTHREAD_LOCAL},
+	{"__typeof",       TTYPEOF},
+	{"__typeof__",     TTYPEOF},
+	{"__volatile__",   TVOLATILE},
+	{"alignas",        TALIGNAS},
+	{"alignof",        TALIGNOF},
+	{"auto",           TAUTO},
+	{"bool",           TBOOL},
+	{"break",          TBREAK},
+	{"case",           TCASE},
+	{"char",           TCHAR},
+	{"const",          TCONST},
+	{"constexpr",      TCONSTEXPR},
+	{"continue",       TCONTINUE},
+	{"default",        TDEFAULT},
+	{"do",             TDO},
+	{"double",         TDOUBLE},
+	{"else",           TELSE},
+	{"enum",           TENUM},
+	{"extern",         TEXTERN},
+	{"false",          TFALSE},
+	{"float",          TFLOAT},
+	{"for",            TFOR},
+	{"goto",           TGOTO},
+	{"if",             TIF},
+	{"inline",         TINLINE},
+	{"int",            TINT},
+	{"long",           TLONG},
+	{"nullptr",        TNULLPTR},
+	{"register",       TREGISTER},
+	{"restrict",       TRESTRICT},
+	{"return",         TRETURN},
+	{"short",          TSHORT},
+	{"signed",         TSIGNED},
+	{"sizeof",         TSIZEOF},
+	{"static",         TSTATIC},
+	{"static_assert",  TSTATIC_ASSERT},
+	{"struct",         TSTRUCT},
+	{"switch",         TSWITCH},
+	{"thread_local",   TTHREAD_LOCAL},
+	{"true",           TTRUE},
+	{"typedef",        TTYPEDEF},
+	{"typeof",         TTYPEOF},
+	{"typeof_unqual",  TTYPEOF_UNQUAL},
+	{"union",          TUNION},
+	{"unsigned",       TUNSIGNED},
+	{"void",           TVOID},
+	{"volatile",       TVOLATILE},
+	{"while",          TWHILE},
+};
 
 void
 ppinit(void)
 {
-	mapinit(&macros, 64);
+	struct atom *a;
+	size_t i;
+
+	for (i = 0; i < LEN(keywords); ++i) {
+		a = intern(keywords[i].name, strlen(keywords[i].name));
+		a->kind = keywords[i].value;
+	}
+	vaargs = intern("__VA_ARGS__", 11)->name;
+	defined = intern("defined", 7)->name;
+	if (ppflags & PPSTATS)
+		stats.start = clock();
 	next();
 }
 
+void
+ppincludedir(char *dir)
+{
+	arrayaddptr(&includedirs, dir);
+}
+
 /* check if two macro definitions are equal, as in C11 6.10.3p2 */
 static bool
 macroequal(struct macro *m1, struct macro *m2)
@@ -74,7 +276,7 @@ macroequal(struct macro *m1, struct macro *m2)
 		if (m1->nparam != m2->nparam)
 			return false;
 		for (p1 = m1->param, p2 = m2->param; p1 < m1->param + m1->nparam; ++p1, ++p2) {
-			if (strcmp(p1->name, p2->name) != 0 || p1->flags != p2->flags)
+			if (p1->name != p2->name || p1->flags != p2->flags)
 				return false;
 		}
 	}
@@ -85,6 +287,8 @@ macroequal(struct macro *m1, struct macro *m2)
 			return false;
 		if (t1->lit && strcmp(t1->lit, t2->lit) != 0)
 			return false;
+		if ((t1->kind == TPARAM || t1->kind == TPARAMSTR) && t1->param != t2->param)
+			return false;
 	}
 	return true;
 }
@@ -97,32 +301,44 @@ macroparam(struct macro *m, struct token *t)
 
 	if (t->kind == TIDENT) {
 		for (i = 0; i < m->nparam; ++i) {
-			if (strcmp(m->param[i].name, t->lit) == 0)
+			if (m->param[i].name == t->lit)
 				return i;
 		}
 	}
 	return -1;
 }
 
-/* lookup a macro by name */
-static struct macro *
-macroget(char *name)
+static void
+macrodone(struct macro *m)
+{
+	m->hide = false;
+	--macrodepth;
+}
+
+/* start allocating from the argument arena for an expansion */
+static size_t
+argpush(void)
 {
-	struct mapkey k;
+	struct argmark *a;
 
-	mapkey(&k, name, strlen(name));
-	return mapget(&macros, &k);
+	a = arrayadd(&argmarks, sizeof(*a));
+	a->arena = argarena;
+	a->done = false;
+	return argmarks.len / sizeof(*a);
 }
 
+/* release the memory of an expansion that ended, and of any that ended after it */
 static void
-macrodone(struct macro *m)
+argpop(size_t i)
 {
-	m->hide = false;
-	if (m->kind == MACROFUNC && m->nparam > 0) {
-		free(m->arg[0].token);
-		free(m->arg);
+	struct argmark *a;
+
+	a = (struct argmark *)argmarks.val + i - 1;
+	a->done = true;
+	for (a = arraylast(&argmarks, sizeof(*a)); argmarks.len > 0 && a->done; --a) {
+		arenarelease(&argarena, &a->arena);
+		argmarks.len -= sizeof(*a);
 	}
-	--macrodepth;
 }
 
 static bool
@@ -144,9 +360,12 @@ ctxpush(struct token *t, size_t n, struct macro *m, bool space)
 	struct frame *f;
 
 	f = arrayadd(&ctx, sizeof(*f));
+	if (ctx.len / sizeof(*f) > stats.maxctx)
+		stats.maxctx = ctx.len / sizeof(*f);
 	f->token = t;
 	f->ntoken = n;
 	f->macro = m;
+	f->mark = 0;
 	if (n > 0)
 		t[0].space = space;
 	return f;
@@ -168,37 +387,289 @@ again:
 			break;
 		if (f->macro)
 			macrodone(f->macro);
+		if (f->mark)
+			argpop(f->mark);
 	}
 	if (ctx.len == 0)
 		return NULL;
 	m = f->macro;
-	if (m && m->kind == MACROFUNC) {
-		/* try to expand macro parameter */
-		space = f->token->space;
-		switch (f->token->kind) {
-		case THASH:
-			framenext(f);
-			t = framenext(f);
-			assert(t);
-			i = macroparam(m, t);
-			assert(i != -1);
-			f = ctxpush(&m->arg[i].str, 1, NULL, space);
-			break;
-		case TIDENT:
-			i = macroparam(m, f->token);
-			if (i == -1)
-				break;
-			framenext(f);
-			if (m->arg[i].ntoken == 0)
-				goto again;
-			f = ctxpush(m->arg[i].token, m->arg[i].ntoken, NULL, space);
-			break;
-		}
-		/* XXX: token concatenation */
+	/* substitute macro parameter */
+	space = f->token->space;
+	switch (f->token->kind) {
+	case TPARAMSTR:
+		t = framenext(f);
+		f = ctxpush(&m->arg[t->param].str, 1, NULL, space);
+		break;
+	case TPARAM:
+		i = framenext(f)->param;
+		if (m->arg[i].ntoken == 0)
+			goto again;
+		f = ctxpush(m->arg[i].token, m->arg[i].ntoken, NULL, space);
+		break;
 	}
 	return framenext(f);
 }
 
+/*
+The header cache stores the tokens of an included file, as seen after
+conditional inclusion but before macro expansion, along with the
+directives that change the preprocessor state, in the order they
+occurred. Replaying it has the same effect as preprocessing the file
+again, provided the file, the files it includes, and the macros defined
+at the point of inclusion are the same.
+*/
+
+enum {
+	CACHETOKEN = 1,
+	CACHEDEFINE,
+	CACHEUNDEF,
+	CACHEGUARD,
+};
+
+static const char cachemagic[] = "cproc header cache 4";
+
+/* recording of the outermost included file not found in the cache */
+static struct {
+	/* depth of the file in the input stack, or 0 if not recording */
+	size_t depth;
+	/* number of open conditionals when the file was included */
+	size_t nconds;
+	/* the recording can't be replayed */
+	bool fail;
+	/* tokens are being read by a directive, rather than for the output */
+	bool indirective;
+	char *file;
+	struct array key, deps, events;
+	/* strings referenced by the recording */
+	struct array strs;
+	struct map strmap;
+	size_t nstrs, ndeps;
+} rec;
+
+/* cached file being replayed */
+static struct {
+	unsigned char *pos, *end;
+	struct {
+		char *str;
+		bool ident;
+	} *strs;
+	size_t nstrs;
+	/* a read went past the end of the entry, or found invalid data */
+	bool bad;
+} replay;
+
+
+static unsigned long long
+hashbytes(unsigned long long h, const void *ptr, size_t len)
+{
+	const unsigned char *pos, *end;
+
+	/* FNV-1a */
+	for (pos = ptr, end = pos + len; pos != end; ++pos)
+		h = (h ^ *pos) * 0x100000001b3;
+	return h;
+}
+
+static unsigned long long
+macrohash(struct macro *m)
+{
+	unsigned long long h;
+	struct macroparam *p;
+	struct token *t;
+	unsigned char c[3];
+
+	h = hashbytes(0xcbf29ce484222325, m->name, strlen(m->name) + 1);
+	c[0] = m->kind;
+	h = hashbytes(h, c, 1);
+	for (p = m->param; p < m->param + m->nparam; ++p) {
+		h = hashbytes(h, p->name, strlen(p->name) + 1);
+		c[0] = p->flags;
+		h = hashbytes(h, c, 1);
+	}
+	for (t = m->token; t < m->token + m->ntoken; ++t) {
+		c[0] = t->kind;
+		c[1] = t->space;
+		c[2] = t->lit != NULL;
+		h = hashbytes(h, c, 3);
+		if (t->lit)
+			h = hashbytes(h, t->lit, strlen(t->lit) + 1);
+		else if (t->kind == TPARAM || t->kind == TPARAMSTR)
+			h = hashbytes(h, &t->param, sizeof(t->param));
+	}
+	return h;
+}
+
+static void
+putint(struct array *a, unsigned long long x)
+{
+	unsigned char *p;
+
+	for (; x > 0x7f; x >>= 7) {
+		p = arrayadd(a, 1);
+		*p = x & 0x7f | 0x80;
+	}
+	p = arrayadd(a, 1);
+	*p = x;
+}
+
+/* add a reference to a string to the recording */
+static void
+putstr(struct array *a, const char *str, bool ident)
+{
+	struct mapkey k;
+	size_t *idx;
+	void **entry;
+	unsigned char c;
+
+	if (!str) {
+		putint(a, 0);
+		return;
+	}
+	if (ident)
+		k = atomof(str)->key;
+	else
+		mapkey(&k, str, strlen(str));
+	entry = mapput(&rec.strmap, &k);
+	idx = *entry;
+	if (!idx) {
+		idx = xmalloc(sizeof(*idx));
+		*idx = ++rec.nstrs;
+		*entry = idx;
+		/* identifiers are interned when the recording is loaded */
+		c = ident;
+		arrayaddbuf(&rec.strs, &c, 1);
+		arrayaddbuf(&rec.strs, str, k.len + 1);
+	}
+	putint(a, *idx);
+}
+
+static void
+puttoken(struct array *a, struct token *t)
+{
+	putint(a, t->kind);
+	putint(a, t->space);
+	putstr(a, t->loc.file, false);
+	putint(a, t->loc.line);
+	putint(a, t->loc.col);
+	putstr(a, t->lit, t->kind == TIDENT || t->kind == TPARAM);
+	if (t->kind == TPARAM || t->kind == TPARAMSTR)
+		putint(a, t->param);
+}
+
+/* add a file the recording depends on */
+static void
+putdep(const char *path, struct stat *st)
+{
+	arrayaddbuf(&rec.deps, path, strlen(path) + 1);
+	putint(&rec.deps, st->st_mtim.tv_sec);
+	putint(&rec.deps, st->st_mtim.tv_nsec);
+	putint(&rec.deps, st->st_size);
+	++rec.ndeps;
+}
+
+/* change the definition of a macro */
+static void
+macroset(struct atom *a, struct macro *m)
+{
+	struct macroparam *p;
+	struct token *t;
+
+	if (ppflags & PPSTATS && m) {
+		/* the count moves to an identical redefinition */
+		if (a->macro) {
+			m->nexpand = a->macro->nexpand;
+			a->macro->nexpand = 0;
+		}
+		arrayaddptr(&stats.macros, m);
+	}
+	if (!cachedir)
+		goto done;
+	if (a->macro)
+		macrodigest ^= macrohash(a->macro);
+	if (m)
+		macrodigest ^= macrohash(m);
+	if (!rec.depth)
+		goto done;
+	if (!m) {
+		putint(&rec.events, CACHEUNDEF);
+		putstr(&rec.events, a->name, true);
+		goto done;
+	}
+	putint(&rec.events, CACHEDEFINE);
+	putstr(&rec.events, m->name, true);
+	putint(&rec.events, m->kind);
+	putint(&rec.events, m->nparam);
+	for (p = m->param; p < m->param + m->nparam; ++p) {
+		putstr(&rec.events, p->name, true);
+		putint(&rec.events, p->flags);
+	}
+	putint(&rec.events, m->ntoken);
+	for (t = m->token; t < m->token + m->ntoken; ++t)
+		puttoken(&rec.events, t);
+done:
+	a->macro = m;
+}
+
+/* record a change to the guard of a file */
+static void
+putguard(struct guard *g)
+{
+	if (!rec.depth)
+		return;
+	putint(&rec.events, CACHEGUARD);
+	putstr(&rec.events, g->path, false);
+	putint(&rec.events, g->once);
+	putstr(&rec.events, g->macro, true);
+}
+
+void
+ppcachedir(char *dir)
+{
+	/* relative include paths are resolved from the working directory */
+	cachecwd = realpath(".", NULL);
+	if (!cachecwd)
+		fatal("realpath:");
+	cachedir = dir;
+}
+
+static int
+expandcmp(const void *p1, const void *p2)
+{
+	struct macro *m1 = *(struct macro **)p1, *m2 = *(struct macro **)p2;
+
+	if (m1->nexpand != m2->nexpand)
+		return m1->nexpand < m2->nexpand ? 1 : -1;
+	return strcmp(m1->name, m2->name);
+}
+
+void
+ppstats(FILE *f)
+{
+	struct macro **m;
+	double time, dirtime;
+	size_t i, n;
+
+	time = (double)(clock() - stats.start) / CLOCKS_PER_SEC;
+	dirtime = (double)stats.dirtime / CLOCKS_PER_SEC;
+	fprintf(f, "tokens:        %lu scanned, %lu replayed, %lu skipped, %lu output\n", stats.tokens, stats.replayed, stats.skipped, stats.output);
+	fprintf(f, "directives:    %lu in %.3fs\n", stats.directives, dirtime);
+	fprintf(f, "expansions:    %lu object-like, %lu function-like\n", stats.objexpand, stats.funcexpand);
+	fprintf(f, "peak depth:    %zu context frames, %zu nested expansions\n", stats.maxctx, stats.maxdepth);
+	fprintf(f, "literals:      %zu bytes\n", stats.litbytes);
+	if (cachedir)
+		fprintf(f, "header cache:  %lu hits, %lu misses\n", stats.cachehits, stats.cachemisses);
+	fprintf(f, "time:          %.3fs, %.0f output tokens/s\n", time, time > 0 ? stats.output / time : 0);
+
+	m = stats.macros.val;
+	n = stats.macros.len / sizeof(*m);
+	qsort(m, n, sizeof(*m), expandcmp);
+	for (i = 0; i < n && i < 20 && m[i]->nexpand > 0; ++i) {
+		if (i == 0)
+			fprintf(f, "most expanded macros:\n");
+		fprintf(f, "%12lu %s\n", m[i]->nexpand, m[i]->name);
+	}
+}
+
 static void
 define(void)
 {
@@ -207,13 +678,15 @@ define(void)
 	struct macro *m;
 	struct macroparam *p;
 	struct array params = {0}, repl = {0};
-	struct mapkey k;
-	void **entry;
+	struct atom *a;
 	size_t i;
+	bool paste;
 
 	m = xmalloc(sizeof(*m));
 	m->name = tokencheck(&tok, TIDENT, "after #define");
 	m->hide = false;
+	m->paste = false;
+	m->nexpand = 0;
 	t = arrayadd(&repl, sizeof(*t));
 	scan(t);
 	if (t->kind == TLPAREN && !t->space) {
@@ -227,10 +700,12 @@ define(void)
 				tokencheck(&tok, TCOMMA, "or ')' after macro parameter");
 				scan(&tok);
 			}
+			if (params.len / sizeof(*p) == USHRT_MAX)
+				error(&tok.loc, "too many macro parameters");
 			p = arrayadd(&params, sizeof(*p));
 			p->flags = 0;
 			if (tok.kind == TELLIPSIS) {
-				p->name = "__VA_ARGS__";
+				p->name = vaargs;
 				p->flags |= PARAMVAR;
 			} else {
 				p->name = tokencheck(&tok, TIDENT, "of macro parameter name or '...'");
@@ -244,87 +719,999 @@ define(void)
 	m->nparam = params.len / sizeof(m->param[0]);
 
 	/* read macro body */
+	if (t->kind == THASHHASH)
+		error(&t->loc, "'##' cannot appear at the start of a replacement list");
 	i = macroparam(m, t);
+	if (i != -1) {
+		t->kind = TPARAM;
+		t->param = i;
+	}
+	paste = false;
 	while (t->kind != TNEWLINE && t->kind != TEOF) {
-		if (t->kind == THASHHASH)
-			error(&t->loc, "'##' operator is not yet implemented");
 		prev = t->kind;
 		t = arrayadd(&repl, sizeof(*t));
 		scan(t);
-		if (t->kind == TIDENT && strcmp(t->lit, "__VA_ARGS__") == 0 && !macrovarargs(m))
+		if (t->kind == TIDENT && t->lit == vaargs && !macrovarargs(m))
 			error(&t->loc, "__VA_ARGS__ can only be used in variadic function-like macros");
+		if (prev == THASHHASH) {
+			if (t->kind == TNEWLINE || t->kind == TEOF)
+				error(&t->loc, "'##' cannot appear at the end of a replacement list");
+			m->paste = true;
+		}
 		if (m->kind != MACROFUNC)
 			continue;
+		/* operands of '##' are not macro-expanded */
 		if (i != -1)
-			m->param[i].flags |= PARAMTOK;
+			m->param[i].flags |= paste || t->kind == THASHHASH ? PARAMRAW : PARAMTOK;
+		paste = prev == THASHHASH;
 		i = macroparam(m, t);
 		if (prev == THASH) {
 			tokencheck(t, TIDENT, "after '#' operator");
 			if (i == -1)
 				error(&t->loc, "'%s' is not a macro parameter name", t->lit);
 			m->param[i].flags |= PARAMSTR;
+			/* replace the '#' operator and its operand with a single token */
+			repl.len -= sizeof(*t);
+			--t;
+			t->kind = TPARAMSTR;
+			t->param = i;
 			i = -1;
+		} else if (i != -1) {
+			t->kind = TPARAM;
+			t->param = i;
 		}
 	}
 	m->token = repl.val;
 	m->ntoken = repl.len / sizeof(*t) - 1;
 	tok = *t;
 
-	mapkey(&k, m->name, strlen(m->name));
-	entry = mapput(&macros, &k);
-	if (*entry && !macroequal(m, *entry))
+	a = atomof(m->name);
+	if (a->macro && !macroequal(m, a->macro))
 		error(&tok.loc, "redefinition of macro '%s'", m->name);
-	*entry = m;
+	macroset(a, m);
 }
 
 static void
 undef(void)
 {
-	char *name;
-	struct mapkey k;
-	void **entry;
+	struct atom *a;
 	struct macro *m;
 
-	name = tokencheck(&tok, TIDENT, "after #undef");
-	mapkey(&k, name, strlen(name));
-	entry = mapput(&macros, &k);
-	m = *entry;
+	a = atomof(tokencheck(&tok, TIDENT, "after #undef"));
+	m = a->macro;
+	macroset(a, NULL);
 	if (m) {
-		free(name);
 		free(m->param);
 		free(m->token);
-		*entry = NULL;
 	}
 	scan(&tok);
 }
 
+static struct token *rawnext(void);
+static bool expand(struct token *);
+
+/* get the next token of a #if expression, evaluating 'defined' operators */
+static void
+ifnext(void)
+{
+	struct token *t;
+	struct location loc;
+	bool paren, def;
+
+	do t = rawnext();
+	while (!(t->kind == TIDENT && t->lit == defined) && expand(t));
+	if (t->kind != TIDENT || t->lit != defined) {
+		tok = *t;
+		return;
+	}
+	loc = t->loc;
+	t = rawnext();
+	paren = t->kind == TLPAREN;
+	if (paren)
+		t = rawnext();
+	def = atomof(tokencheck(t, TIDENT, "after 'defined'"))->macro != NULL;
+	if (paren) {
+		t = rawnext();
+		tokencheck(t, TRPAREN, "after 'defined' operand");
+	}
+	tok = (struct token){.kind = TNUMBER, .loc = loc, .lit = def ? "1" : "0"};
+}
+
+static struct condval ifcond(bool);
+
+static struct condval
+ifunary(bool eval)
+{
+	struct condval v;
+	enum tokenkind op;
+	char *end;
+
+	switch (tok.kind) {
+	case TADD:
+	case TSUB:
+	case TBNOT:
+	case TLNOT:
+		op = tok.kind;
+		ifnext();
+		v = ifunary(eval);
+		switch (op) {
+		case TSUB:  v.v = -v.v; break;
+		case TBNOT: v.v = ~v.v; break;
+		case TLNOT: v.v = !v.v, v.u = false; break;
+		}
+		return v;
+	case TLPAREN:
+		ifnext();
+		v = ifcond(eval);
+		tokencheck(&tok, TRPAREN, "after expression");
+		break;
+	case TNUMBER:
+		if (tok.lit[0] == '0' && tolower(tok.lit[1]) == 'b')
+			v.v = strtoull(tok.lit + 2, &end, 2);
+		else
+			v.v = strtoull(tok.lit, &end, 0);
+		v.u = v.v > LLONG_MAX;
+		for (; *end; ++end) {
+			if (tolower(*end) == 'u')
+				v.u = true;
+			else if (tolower(*end) != 'l')
+				error(&tok.loc, "invalid integer constant '%s' in #if", tok.lit);
+		}
+		break;
+	case TCHARCONST:
+		charconstvalue(tok.lit, &v.v, &tok.loc);
+		v.u = false;
+		break;
+	case TIDENT:
+		/* identifiers remaining after macro expansion are replaced with 0 */
+		v.v = 0;
+		v.u = false;
+		break;
+	default:
+		error(&tok.loc, "expected expression in #if");
+	}
+	ifnext();
+	return v;
+}
+
+static int
+ifprec(enum tokenkind op)
+{
+	switch (op) {
+	case TMUL:
+	case TDIV:
+	case TMOD:     return 10;
+	case TADD:
+	case TSUB:     return 9;
+	case TSHL:
+	case TSHR:     return 8;
+	case TLESS:
+	case TGREATER:
+	case TLEQ:
+	case TGEQ:     return 7;
+	case TEQL:
+	case TNEQ:     return 6;
+	case TBAND:    return 5;
+	case TXOR:     return 4;
+	case TBOR:     return 3;
+	case TLAND:    return 2;
+	case TLOR:     return 1;
+	}
+	return 0;
+}
+
+/* parse binary operators with precedence at least prec */
+static struct condval
+ifbinary(int prec, bool eval)
+{
+	struct condval l, r;
+	struct location loc;
+	enum tokenkind op;
+	int p;
+	bool u;
+
+	l = ifunary(eval);
+	while ((p = ifprec(tok.kind)) >= prec) {
+		op = tok.kind;
+		loc = tok.loc;
+		ifnext();
+		switch (op) {
+		case TLAND: r = ifbinary(p + 1, eval && l.v); break;
+		case TLOR:  r = ifbinary(p + 1, eval && !l.v); break;
+		default:    r = ifbinary(p + 1, eval);
+		}
+		u = l.u || r.u;
+		switch (op) {
+		case TMUL:     l.v *= r.v; break;
+		case TDIV:
+		case TMOD:
+			if (r.v == 0) {
+				if (eval)
+					error(&loc, "division by zero in #if");
+				l.v = 0;
+			} else if (u) {
+				l.v = op == TDIV ? l.v / r.v : l.v % r.v;
+			} else if ((long long)r.v == -1) {
+				/* avoid trapping on LLONG_MIN / -1 */
+				if (op == TDIV && l.v == 1ull << 63 && eval)
+					warning(&loc, "integer overflow in #if");
+				l.v = op == TDIV ? -l.v : 0;
+			} else {
+				l.v = op == TDIV ? (long long)l.v / (long long)r.v : (long long)l.v % (long long)r.v;
+			}
+			break;
+		case TADD:     l.v += r.v; break;
+		case TSUB:     l.v -= r.v; break;
+		case TSHL:     l.v <<= r.v & 63; u = l.u; break;
+		case TSHR:     l.v = l.u ? l.v >> (r.v & 63) : (long long)l.v >> (r.v & 63); u = l.u; break;
+		case TLESS:    l.v = u ? l.v < r.v : (long long)l.v < (long long)r.v; u = false; break;
+		case TGREATER: l.v = u ? l.v > r.v : (long long)l.v > (long long)r.v; u = false; break;
+		case TLEQ:     l.v = u ? l.v <= r.v : (long long)l.v <= (long long)r.v; u = false; break;
+		case TGEQ:     l.v = u ? l.v >= r.v : (long long)l.v >= (long long)r.v; u = false; break;
+		case TEQL:     l.v = l.v == r.v; u = false; break;
+		case TNEQ:     l.v = l.v != r.v; u = false; break;
+		case TBAND:    l.v &= r.v; break;
+		case TXOR:     l.v ^= r.v; break;
+		case TBOR:     l.v |= r.v; break;
+		case TLAND:    l.v = l.v && r.v; u = false; break;
+		case TLOR:     l.v = l.v || r.v; u = false; break;
+		}
+		l.u = u;
+	}
+	return l;
+}
+
+/* parse a conditional expression, only diagnosing errors if eval is set */
+static struct condval
+ifcond(bool eval)
+{
+	struct condval c, l, r;
+
+	c = ifbinary(1, eval);
+	if (tok.kind != TQUESTION)
+		return c;
+	ifnext();
+	l = ifcond(eval && c.v);
+	tokencheck(&tok, TCOLON, "in conditional expression");
+	ifnext();
+	r = ifcond(eval && !c.v);
+	l.v = c.v ? l.v : r.v;
+	l.u = l.u || r.u;
+	return l;
+}
+
+/* evaluate the controlling expression of #if or #elif */
+static bool
+ifexpr(void)
+{
+	ifnext();
+	return ifcond(true).v != 0;
+}
+
+static void
+condpush(bool done, struct location *loc)
+{
+	struct cond *c;
+
+	c = arrayadd(&conds, sizeof(*c));
+	c->done = done;
+	c->sawelse = false;
+	c->loc = *loc;
+	c->guard = NULL;
+}
+
+static void
+condpop(void)
+{
+	struct cond *c;
+
+	c = arraylast(&conds, sizeof(*c));
+	conds.len -= sizeof(*c);
+	/* #ifndef X ... #endif surrounds the whole file, with no #elif or #else */
+	if (c->guard && scanateof()) {
+		c->guard->macro = c->macro;
+		putguard(c->guard);
+	}
+}
+
+static struct cond *
+condlast(const char *name)
+{
+	struct file *f;
+	size_t nconds;
+
+	/* a conditional must end in the file where it began */
+	nconds = 0;
+	if (files.len > 0) {
+		f = arraylast(&files, sizeof(*f));
+		nconds = f->nconds;
+	}
+	if (conds.len <= nconds)
+		error(&tok.loc, "#%s directive without #if", name);
+	return arraylast(&conds, sizeof(struct cond));
+}
+
+/* check that included files which have ended closed their conditionals */
+static void
+fileend(void)
+{
+	struct file *f;
+	struct cond *c;
+
+	while (files.len > 0) {
+		f = arraylast(&files, sizeof(*f));
+		if (scandepth() >= f->depth)
+			break;
+		if (conds.len > f->nconds) {
+			c = arraylast(&conds, sizeof(*c));
+			error(&c->loc, "unterminated conditional directive");
+		}
+		files.len -= sizeof(*f);
+	}
+}
+
+/* skip groups of the current conditional until one is included or it ends */
+static void
+skipgroup(void)
+{
+	struct cond *c;
+	size_t depth;
+	bool newline;
+	char *name;
+
+	c = arraylast(&conds, sizeof(*c));
+	depth = 0;
+	newline = true;
+	for (;;) {
+		scanskipped(&tok);
+		fileend();
+		++stats.skipped;
+		if (tok.kind == TEOF)
+			error(&c->loc, "unterminated conditional directive");
+		if (!newline || tok.kind != THASH) {
+			newline = tok.kind == TNEWLINE;
+			continue;
+		}
+		scanskipped(&tok);
+		newline = tok.kind == TNEWLINE;
+		if (tok.kind != TIDENT)
+			continue;
+		name = tok.lit;
+		if (strcmp(name, "if") == 0 || strcmp(name, "ifdef") == 0 || strcmp(name, "ifndef") == 0) {
+			++depth;
+		} else if (depth > 0) {
+			if (strcmp(name, "endif") == 0)
+				--depth;
+		} else if (strcmp(name, "elif") == 0) {
+			if (c->sawelse)
+				error(&tok.loc, "#elif directive after #else");
+			c->guard = NULL;
+			if (!c->done) {
+				c->done = ifexpr();
+				tokencheck(&tok, TNEWLINE, "after #elif expression");
+				if (c->done)
+					break;
+				newline = true;
+			}
+		} else if (strcmp(name, "else") == 0) {
+			if (c->sawelse)
+				error(&tok.loc, "#else directive after #else");
+			c->sawelse = true;
+			c->guard = NULL;
+			scan(&tok);
+			tokencheck(&tok, TNEWLINE, "after #else");
+			newline = true;
+			if (!c->done) {
+				c->done = true;
+				break;
+			}
+		} else if (strcmp(name, "endif") == 0) {
+			condpop();
+			scan(&tok);
+			tokencheck(&tok, TNEWLINE, "after #endif");
+			break;
+		}
+	}
+}
+
+/* find the guard of a file, or NULL if it does not exist */
+static struct guard *
+guardget(const char *path)
+{
+	struct mapkey k;
+	struct guard *g;
+	void **entry;
+	char *real;
+
+	real = realpath(path, NULL);
+	if (!real)
+		return NULL;
+	if (!guards.cap)
+		mapinit(&guards, 64);
+	mapkey(&k, real, strlen(real));
+	entry = mapput(&guards, &k);
+	g = *entry;
+	if (g) {
+		free(real);
+	} else {
+		g = xmalloc(sizeof(*g));
+		g->path = real;
+		g->once = false;
+		g->macro = NULL;
+		*entry = g;
+	}
+	return g;
+}
+
+static unsigned long long
+getint(void)
+{
+	unsigned long long x;
+	int shift, c;
+
+	x = 0;
+	for (shift = 0; replay.pos != replay.end && shift < 64; shift += 7) {
+		c = *replay.pos++;
+		x |= (unsigned long long)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return x;
+	}
+	replay.bad = true;
+	return 0;
+}
+
+/* get a nul-terminated string stored in the entry itself */
+static char *
+getlit(size_t *len)
+{
+	unsigned char *end;
+	char *str;
+
+	end = memchr(replay.pos, '\0', replay.end - replay.pos);
+	if (!end) {
+		replay.bad = true;
+		return NULL;
+	}
+	str = (char *)replay.pos;
+	*len = end - replay.pos;
+	replay.pos = end + 1;
+	return str;
+}
+
+static char *
+getstr(bool ident)
+{
+	size_t i;
+
+	i = getint();
+	if (i == 0)
+		return NULL;
+	if (i > replay.nstrs || ident && !replay.strs[i - 1].ident) {
+		replay.bad = true;
+		return NULL;
+	}
+	return replay.strs[i - 1].str;
+}
+
+static void
+gettoken(struct token *t)
+{
+	t->kind = getint();
+	t->space = getint();
+	t->hide = false;
+	t->loc.file = getstr(false);
+	t->loc.line = getint();
+	t->loc.col = getint();
+	t->lit = getstr(t->kind == TIDENT || t->kind == TPARAM);
+	if (t->kind == TPARAM || t->kind == TPARAMSTR)
+		t->param = getint();
+}
+
+/* get the next token of the file being replayed, applying its directives */
+static bool
+cachenext(struct token *t)
+{
+	struct macro *m;
+	struct guard *g;
+	struct atom *a;
+	bool once;
+	char *path, *macro;
+	size_t i;
+
+	while (replay.pos != replay.end) {
+		switch (*replay.pos++) {
+		case CACHETOKEN:
+			gettoken(t);
+			return true;
+		case CACHEDEFINE:
+			m = xmalloc(sizeof(*m));
+			m->name = getstr(true);
+			m->hide = false;
+			m->nexpand = 0;
+			m->kind = getint();
+			m->nparam = getint();
+			m->param = xreallocarray(NULL, m->nparam, sizeof(m->param[0]));
+			for (i = 0; i < m->nparam; ++i) {
+				m->param[i].name = getstr(true);
+				m->param[i].flags = getint();
+			}
+			m->ntoken = getint();
+			m->token = xreallocarray(NULL, m->ntoken, sizeof(m->token[0]));
+			m->paste = false;
+			for (i = 0; i < m->ntoken; ++i) {
+				gettoken(&m->token[i]);
+				if (m->token[i].kind == THASHHASH)
+					m->paste = true;
+			}
+			macroset(atomof(m->name), m);
+			break;
+		case CACHEUNDEF:
+			a = atomof(getstr(true));
+			m = a->macro;
+			macroset(a, NULL);
+			if (m) {
+				free(m->param);
+				free(m->token);
+			}
+			break;
+		case CACHEGUARD:
+			path = getstr(false);
+			once = getint();
+			macro = getstr(true);
+			g = guardget(path);
+			if (g) {
+				g->once = once;
+				g->macro = macro;
+				putguard(g);
+			}
+			break;
+		default:
+			fatal("corrupt header cache entry");
+		}
+	}
+	free(replay.strs);
+	replay.strs = NULL;
+	replay.pos = replay.end = NULL;
+	return false;
+}
+
+/* read a token, and check that it is valid in a macro with nparam parameters */
+static void
+checktoken(size_t nparam)
+{
+	struct token t;
+
+	gettoken(&t);
+	switch (t.kind) {
+	case TPARAM:
+	case TPARAMSTR:
+		if (t.param >= nparam)
+			replay.bad = true;
+		break;
+	case TIDENT:
+	case TNUMBER:
+	case TCHARCONST:
+	case TSTRINGLIT:
+	case TOTHER:
+		if (!t.lit)
+			replay.bad = true;
+		break;
+	default:
+		if (t.kind > THASHHASH)
+			replay.bad = true;
+	}
+}
+
+/* check that the events of an entry are valid, without applying them */
+static bool
+cachecheck(void)
+{
+	unsigned long long kind;
+	unsigned char *pos;
+	size_t i, n;
+
+	pos = replay.pos;
+	while (replay.pos != replay.end && !replay.bad) {
+		switch (*replay.pos++) {
+		case CACHETOKEN:
+			checktoken(0);
+			break;
+		case CACHEDEFINE:
+			if (!getstr(true))
+				replay.bad = true;
+			kind = getint();
+			if (kind != MACROOBJ && kind != MACROFUNC)
+				replay.bad = true;
+			n = getint();
+			for (i = 0; i < n && !replay.bad; ++i) {
+				if (!getstr(true))
+					replay.bad = true;
+				getint();
+			}
+			/* only function-like macros have their arguments set */
+			if (kind != MACROFUNC)
+				n = 0;
+			i = getint();
+			while (i-- > 0 && !replay.bad)
+				checktoken(n);
+			break;
+		case CACHEUNDEF:
+			if (!getstr(true))
+				replay.bad = true;
+			break;
+		case CACHEGUARD:
+			if (!getstr(false))
+				replay.bad = true;
+			getint();
+			getstr(true);
+			break;
+		default:
+			replay.bad = true;
+		}
+	}
+	replay.pos = pos;
+	return !replay.bad;
+}
+
+/* start replaying a cache entry, if it exists and is up to date */
+static bool
+cacheload(const char *file, struct array *key)
+{
+	struct stat st;
+	unsigned char *data, *deps, *depsend;
+	size_t i, n, ndeps, len, size;
+	char *str;
+	bool ident;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return false;
+	if (fstat(fd, &st) != 0 || st.st_size < key->len) {
+		close(fd);
+		return false;
+	}
+	size = st.st_size;
+	/* number literals are lowercased in place, so the mapping must be writable */
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+	if (memcmp(data, key->val, key->len) != 0)
+		goto stale;
+	replay.pos = data + key->len;
+	replay.end = data + size;
+	replay.nstrs = 0;
+	replay.bad = false;
+	n = getint();
+	deps = replay.pos;
+	for (i = 0; i < n && !replay.bad; ++i) {
+		str = getlit(&len);
+		if (!str || stat(str, &st) != 0)
+			goto stale;
+		if (getint() != st.st_mtim.tv_sec || getint() != st.st_mtim.tv_nsec || getint() != st.st_size)
+			goto stale;
+	}
+	if (replay.bad)
+		goto stale;
+	ndeps = n;
+	depsend = replay.pos;
+	n = getint();
+	/* each string takes at least two bytes */
+	if (n > (replay.end - replay.pos) / 2)
+		goto stale;
+	replay.strs = xreallocarray(NULL, n, sizeof(replay.strs[0]));
+	for (i = 0; i < n; ++i) {
+		ident = getint();
+		str = getlit(&len);
+		if (!str)
+			goto stale;
+		replay.strs[i].str = ident ? intern(str, len)->name : str;
+		replay.strs[i].ident = ident;
+	}
+	replay.nstrs = n;
+	n = getint();
+	if (replay.bad || n != replay.end - replay.pos || !cachecheck())
+		goto stale;
+	/* a file including this one depends on the same files */
+	if (rec.depth) {
+		arrayaddbuf(&rec.deps, deps, depsend - deps);
+		rec.ndeps += ndeps;
+	}
+	return true;
+
+stale:
+	free(replay.strs);
+	replay.strs = NULL;
+	replay.pos = replay.end = NULL;
+	munmap(data, size);
+	return false;
+}
+
+/* replay an included file from the cache, or prepare to record it */
+static bool
+cacheinclude(const char *path)
+{
+	struct array key = {0};
+	struct stat st;
+	unsigned long long h;
+	char **dir, *file;
+
+	if (stat(path, &st) != 0)
+		return false;
+	h = macrodigest;
+	arrayforeach (&includedirs, dir)
+		h = hashbytes(h, *dir, strlen(*dir) + 1);
+	arrayaddbuf(&key, cachemagic, sizeof(cachemagic));
+	arrayaddbuf(&key, cachecwd, strlen(cachecwd) + 1);
+	arrayaddbuf(&key, path, strlen(path) + 1);
+	putint(&key, h);
+	file = xmalloc(strlen(cachedir) + 18);
+	sprintf(file, "%s/%016llx", cachedir, hashbytes(0xcbf29ce484222325, key.val, key.len));
+	if (cacheload(file, &key)) {
+		++stats.cachehits;
+		free(key.val);
+		free(file);
+		return true;
+	}
+	++stats.cachemisses;
+	if (!rec.depth) {
+		free(rec.key.val);
+		free(rec.file);
+		rec.key = key;
+		rec.file = file;
+		rec.deps.len = 0;
+		rec.ndeps = 0;
+	} else {
+		free(key.val);
+		free(file);
+	}
+	putdep(path, &st);
+	return false;
+}
+
+/* start recording the file that was just included */
+static void
+cacherecord(void)
+{
+	rec.depth = scandepth();
+	rec.nconds = conds.len;
+	rec.fail = false;
+	mapinit(&rec.strmap, 256);
+}
+
+static bool
+cachewrite(FILE *f, struct array *a)
+{
+	return fwrite(a->val, 1, a->len, f) == a->len;
+}
+
+/* finish the recording, and write it to the cache */
+static void
+cachefinish(void)
+{
+	struct array head = {0};
+	char *tmp;
+	FILE *f;
+	bool ok;
+
+	rec.depth = 0;
+	/* a conditional spanning the end of the file can't be replayed */
+	if (rec.fail || conds.len != rec.nconds)
+		goto done;
+	/* write to a temporary file, so that concurrent readers never see partial entries */
+	tmp = xmalloc(strlen(rec.file) + 24);
+	sprintf(tmp, "%s.%ld", rec.file, (long)getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		free(tmp);
+		goto done;
+	}
+	ok = cachewrite(f, &rec.key);
+	putint(&head, rec.ndeps);
+	ok = ok && cachewrite(f, &head) && cachewrite(f, &rec.deps);
+	head.len = 0;
+	putint(&head, rec.nstrs);
+	ok = ok && cachewrite(f, &head) && cachewrite(f, &rec.strs);
+	/* the length of the events lets a reader detect a truncated entry */
+	head.len = 0;
+	putint(&head, rec.events.len);
+	ok = ok && cachewrite(f, &head) && cachewrite(f, &rec.events);
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp, rec.file) != 0)
+		remove(tmp);
+	free(tmp);
+	free(head.val);
+done:
+	mapfree(&rec.strmap, free);
+	rec.strs.len = 0;
+	rec.events.len = 0;
+	rec.nstrs = 0;
+}
+
+static bool
+includepath(struct array *path, const char *dir, size_t dirlen, const char *name, size_t namelen)
+{
+	struct guard *g;
+	struct file *f;
+
+	path->len = 0;
+	if (dirlen > 0) {
+		arrayaddbuf(path, dir, dirlen);
+		arrayaddbuf(path, "/", 1);
+	}
+	arrayaddbuf(path, name, namelen);
+	arrayaddbuf(path, "", 1);
+	g = guardget(path->val);
+	if (!g)
+		return false;
+	/* skip the file without opening it if it would have no effect */
+	if (g->once || g->macro && atomof(g->macro)->macro) {
+		/* whether a #pragma once file was seen is not part of the cache key */
+		if (g->once)
+			rec.fail = true;
+		return true;
+	}
+	if (cachedir && cacheinclude(path->val))
+		return true;
+	if (!scaninclude(path->val))
+		return false;
+	f = arrayadd(&files, sizeof(*f));
+	f->depth = scandepth();
+	f->nconds = conds.len;
+	newfile = g;
+	if (cachedir && !rec.depth)
+		cacherecord();
+	return true;
+}
+
+/* get the next token of #include, expanding macros if its operand was not a header name */
+static void
+includenext(bool macros)
+{
+	struct token *t;
+
+	if (!macros) {
+		scan(&tok);
+		return;
+	}
+	do t = rawnext();
+	while (expand(t));
+	tok = *t;
+}
+
+static void
+include(void)
+{
+	struct array name = {0}, path = {0};
+	struct location loc;
+	const char *lit, *dir, **d;
+	bool quote, macros;
+
+	scan(&tok);
+	loc = tok.loc;
+	macros = tok.kind != TSTRINGLIT && tok.kind != TLESS;
+	if (macros) {
+		/* the tokens are macro-expanded, and must then match one of the other forms */
+		while (expand(&tok))
+			includenext(true);
+	}
+	switch (tok.kind) {
+	case TSTRINGLIT:
+		if (tok.lit[0] != '"')
+			error(&tok.loc, "invalid #include file name %s", tok.lit);
+		arrayaddbuf(&name, tok.lit + 1, strlen(tok.lit) - 2);
+		quote = true;
+		break;
+	case TLESS:
+		/* reconstruct the header name from its tokens */
+		for (;;) {
+			includenext(macros);
+			if (tok.kind == TGREATER)
+				break;
+			if (tok.kind == TNEWLINE || tok.kind == TEOF)
+				error(&tok.loc, "expected '>' after #include file name");
+			if (tok.space && name.len > 0)
+				arrayaddbuf(&name, " ", 1);
+			lit = tok.lit ? tok.lit : tokstr[tok.kind];
+			arrayaddbuf(&name, lit, strlen(lit));
+		}
+		quote = false;
+		break;
+	default:
+		error(&tok.loc, "expected \"FILENAME\" or <FILENAME> after #include");
+	}
+	includenext(macros);
+	tokencheck(&tok, TNEWLINE, "after #include");
+
+	if (name.len > 0 && ((char *)name.val)[0] == '/') {
+		if (includepath(&path, NULL, 0, name.val, name.len))
+			goto done;
+	} else {
+		if (quote) {
+			/* search the directory of the current file first */
+			dir = strrchr(loc.file, '/');
+			if (includepath(&path, loc.file, dir ? dir - loc.file : 0, name.val, name.len))
+				goto done;
+		}
+		arrayforeach (&includedirs, d) {
+			if (includepath(&path, *d, strlen(*d), name.val, name.len))
+				goto done;
+		}
+	}
+	error(&loc, "could not find include file '%.*s'", (int)name.len, (char *)name.val);
+done:
+	/* the path is now used as the location of the included file */
+	free(name.val);
+}
+
 static void
 directive(void)
 {
-	struct location newloc;
+	struct location newloc, loc;
 	enum ppflags oldflags;
-	char *name = NULL;
+	struct cond *c;
+	struct guard *guard;
+	char *name = NULL, *macro;
+	bool skip = false, def;
+	clock_t start = 0;
 
 	scan(&tok);
 	if (tok.kind == TNEWLINE)
 		return;  /* empty directive */
+	++stats.directives;
+	if (ppflags & PPSTATS)
+		start = clock();
+	/* only #ifndef may start a guarded file */
+	guard = newfile;
+	newfile = NULL;
 	oldflags = ppflags;
 	ppflags |= PPNEWLINE;
+	rec.indirective = true;
 	if (tok.kind == TNUMBER)
 		goto line;  /* gcc line markers */
 	name = tokencheck(&tok, TIDENT, "newline, or number after '#'");
 	if (strcmp(name, "if") == 0) {
-		error(&tok.loc, "#if directive is not implemented");
-	} else if (strcmp(name, "ifdef") == 0) {
-		error(&tok.loc, "#ifdef directive is not implemented");
-	} else if (strcmp(name, "ifndef") == 0) {
-		error(&tok.loc, "#ifndef directive is not implemented");
+		loc = tok.loc;
+		def = ifexpr();
+		condpush(def, &loc);
+		skip = !def;
+	} else if (strcmp(name, "ifdef") == 0 || strcmp(name, "ifndef") == 0) {
+		loc = tok.loc;
+		scan(&tok);
+		macro = tokencheck(&tok, TIDENT, "after #ifdef or #ifndef");
+		def = atomof(macro)->macro != NULL;
+		scan(&tok);
+		skip = def != (name[2] == 'd');
+		condpush(!skip, &loc);
+		if (guard && name[2] == 'n') {
+			c = arraylast(&conds, sizeof(*c));
+			c->guard = guard;
+			c->macro = macro;
+		}
 	} else if (strcmp(name, "elif") == 0) {
-		error(&tok.loc, "#elif directive is not implemented");
+		c = condlast(name);
+		if (c->sawelse)
+			error(&tok.loc, "#elif directive after #else");
+		c->guard = NULL;
+		/* a previous group was included, so the expression is not evaluated */
+		do scan(&tok);
+		while (tok.kind != TNEWLINE && tok.kind != TEOF);
+		skip = true;
+	} else if (strcmp(name, "else") == 0) {
+		c = condlast(name);
+		if (c->sawelse)
+			error(&tok.loc, "#else directive after #else");
+		c->sawelse = true;
+		c->guard = NULL;
+		scan(&tok);
+		skip = true;
 	} else if (strcmp(name, "endif") == 0) {
-		error(&tok.loc, "#endif directive is not implemented");
+		condlast(name);
+		condpop();
+		scan(&tok);
 	} else if (strcmp(name, "include") == 0) {
-		error(&tok.loc, "#include directive is not implemented");
+		include();
 	} else if (strcmp(name, "define") == 0) {
 		scan(&tok);
 		define();
@@ -351,14 +1738,27 @@ line:
 	} else if (strcmp(name, "error") == 0) {
 		error(&tok.loc, "#error directive is not implemented");
 	} else if (strcmp(name, "pragma") == 0) {
+		scan(&tok);
+		if (tok.kind == TIDENT && strcmp(tok.lit, "once") == 0) {
+			guard = guardget(scanname());
+			if (guard) {
+				guard->once = true;
+				putguard(guard);
+			}
+			scan(&tok);
+		}
 		while (tok.kind != TNEWLINE && tok.kind != TEOF)
 			next();
 	} else {
 		error(&tok.loc, "invalid preprocessor directive #%s", name);
 	}
-	free(name);
 	tokencheck(&tok, TNEWLINE, "after preprocessing directive");
+	if (skip)
+		skipgroup();
 	ppflags = oldflags;
+	rec.indirective = false;
+	if (ppflags & PPSTATS)
+		stats.dirtime += clock() - start;
 }
 
 /* get the next token without expanding it */
@@ -366,16 +1766,35 @@ static void
 nextinto(struct token *t)
 {
 	static bool newline = true;
+	struct cond *c;
 
 	for (;;) {
+		if (replay.pos && cachenext(t)) {
+			++stats.replayed;
+			break;
+		}
 		scan(t);
+		fileend();
+		++stats.tokens;
+		if (rec.depth && scandepth() < rec.depth)
+			cachefinish();
 		if (newline && t->kind == THASH) {
 			directive();
 		} else {
-			newline = tok.kind == TNEWLINE;
+			if (t->kind != TNEWLINE)
+				newfile = NULL;
+			if (t->kind == TEOF && conds.len > 0) {
+				c = arraylast(&conds, sizeof(*c));
+				error(&c->loc, "unterminated conditional directive");
+			}
 			break;
 		}
 	}
+	newline = t->kind == TNEWLINE;
+	if (rec.depth && !rec.indirective) {
+		putint(&rec.events, CACHETOKEN);
+		puttoken(&rec.events, t);
+	}
 }
 
 static struct token *
@@ -395,7 +1814,7 @@ static bool
 peekparen(void)
 {
 	static struct array pending;
-	struct token *t;
+	struct token *t, name;
 	struct frame *f;
 
 	t = ctxnext();
@@ -408,8 +1827,12 @@ peekparen(void)
 		return false;
 	}
 	pending.len = 0;
+	/* the macro name may be in tok, which directives on the following lines overwrite */
+	name = tok;
+	/* a directive ends at the newline, which is never followed by '(' */
 	do t = arrayadd(&pending, sizeof(*t)), nextinto(t);
-	while (t->kind == TNEWLINE);
+	while (t->kind == TNEWLINE && !rec.indirective);
+	tok = name;
 	if (t->kind == TLPAREN)
 		return true;
 	t = pending.val;
@@ -436,55 +1859,92 @@ stringize(struct array *buf, struct token *t)
 	}
 }
 
-static void expandfunc(struct macro *);
+static size_t expandfunc(struct macro *);
+static void pastemacro(struct macro *);
 
 static bool
 expand(struct token *t)
 {
 	struct macro *m;
+	struct frame *f;
+	size_t mark;
 	bool space;
 
 	if (t->kind != TIDENT)
 		return false;
-	m = macroget(t->lit);
+	m = atomof(t->lit)->macro;
 	if (!m || m->hide)
 		t->hide = true;
 	if (t->hide)
 		return false;
 	space = t->space;
+	mark = 0;
 	if (m->kind == MACROFUNC) {
 		if (!peekparen())
 			return false;
-		expandfunc(m);
+		mark = expandfunc(m);
+	}
+	if (m->paste) {
+		if (!mark)
+			mark = argpush();
+		pastemacro(m);
+		f = ctxpush(m->pasted, m->npasted, m, space);
+	} else {
+		f = ctxpush(m->token, m->ntoken, m, space);
 	}
-	ctxpush(m->token, m->ntoken, m, space);
+	f->mark = mark;
 	m->hide = true;
-	++macrodepth;
+	++m->nexpand;
+	if (m->kind == MACROFUNC)
+		++stats.funcexpand;
+	else
+		++stats.objexpand;
+	if (++macrodepth > stats.maxdepth)
+		stats.maxdepth = macrodepth;
 	return true;
 }
 
-static void
+/* copy a buffer to the argument arena */
+static void *
+argsave(const void *buf, size_t len)
+{
+	return len > 0 ? memcpy(arenaalloc(&argarena, len), buf, len) : NULL;
+}
+
+/* read the arguments of a macro invocation, and return the position of its expansion in argmarks */
+static size_t
 expandfunc(struct macro *m)
 {
 	struct macroparam *p;
 	struct macroarg *arg;
-	struct array str, tok;
-	size_t i, depth, paren;
+	struct argbuf *b;
+	size_t i, depth, paren, mark;
 	struct token *t;
+	char *lit;
+
+	if (argdepth == argbufs.len / sizeof(b)) {
+		b = xmalloc(sizeof(*b));
+		*b = (struct argbuf){0};
+		arrayaddptr(&argbufs, b);
+	}
+	b = ((struct argbuf **)argbufs.val)[argdepth++];
+	b->arg.len = 0;
+	b->tok.len = 0;
+	b->raw.len = 0;
 
 	/* read macro arguments */
 	paren = 0;
 	depth = macrodepth;
-	tok = (struct array){0};
-	arg = xreallocarray(NULL, m->nparam, sizeof(*arg));
+	arg = arrayadd(&b->arg, m->nparam * sizeof(*arg));
 	t = rawnext();
 	for (i = 0; i < m->nparam; ++i) {
 		p = &m->param[i];
 		if (p->flags & PARAMSTR) {
-			str = (struct array){0};
-			arrayaddbuf(&str, "\"", 1);
+			b->str.len = 0;
+			arrayaddbuf(&b->str, "\"", 1);
 		}
 		arg[i].ntoken = 0;
+		arg[i].nraw = 0;
 		for (;;) {
 			if (t->kind == TEOF)
 				error(&t->loc, "EOF when reading macro parameters");
@@ -498,19 +1958,26 @@ expandfunc(struct macro *m)
 				case TRPAREN: --paren; break;
 				}
 				if (p->flags & PARAMSTR)
-					stringize(&str, t);
+					stringize(&b->str, t);
+				if (p->flags & PARAMRAW) {
+					arrayaddbuf(&b->raw, t, sizeof(*t));
+					++arg[i].nraw;
+				}
 			}
 			if (p->flags & PARAMTOK && !expand(t)) {
-				arrayaddbuf(&tok, t, sizeof(*t));
+				arrayaddbuf(&b->tok, t, sizeof(*t));
 				++arg[i].ntoken;
 			}
 			t = rawnext();
 		}
 		if (p->flags & PARAMSTR) {
-			arrayaddbuf(&str, "\"", 2);
+			arrayaddbuf(&b->str, "\"", 2);
+			lit = arenaalloc(&litarena, b->str.len);
+			stats.litbytes += b->str.len;
+			memcpy(lit, b->str.val, b->str.len);
 			arg[i].str = (struct token){
 				.kind = TSTRINGLIT,
-				.lit = str.val,
+				.lit = lit,
 			};
 		}
 		if (t->kind == TRPAREN)
@@ -521,108 +1988,108 @@ expandfunc(struct macro *m)
 		error(&t->loc, "not enough arguments for macro '%s'", m->name);
 	if (t->kind != TRPAREN)
 		error(&t->loc, "too many arguments for macro '%s'", m->name);
-	for (i = 0, t = tok.val; i < m->nparam; ++i) {
-		arg[i].token = t;
-		t += arg[i].ntoken;
+	--argdepth;
+
+	/* nested invocations are done allocating, so the arguments can be moved to the arena */
+	mark = argpush();
+	m->arg = argsave(arg, b->arg.len);
+	t = argsave(b->tok.val, b->tok.len);
+	for (i = 0; i < m->nparam; ++i) {
+		m->arg[i].token = t;
+		t += m->arg[i].ntoken;
+	}
+	t = argsave(b->raw.val, b->raw.len);
+	for (i = 0; i < m->nparam; ++i) {
+		m->arg[i].raw = t;
+		t += m->arg[i].nraw;
 	}
-	m->arg = arg;
+	return mark;
 }
 
+/* concatenate two tokens with the '##' operator */
 static void
-keyword(struct token *tok)
+pastetoken(struct token *l, struct token *r)
 {
-	static const struct {
-		const char *name;
-		int value;
-	} keywords[] = {
-		{"_Alignas",       TALIGNAS},
-		{"_Alignof",       TALIGNOF},
-		{"_Atomic",        T_ATOMIC},
-		{"_Bool",          TBOOL},
-		{"_Complex",       T_COMPLEX},
-		{"_Decimal128",    T_DECIMAL128},
-		{"_Decimal32",     T_DECIMAL32},
-		{"_Decimal64",     T_DECIMAL64},
-		{"_Generic",       T_GENERIC},
-		{"_Imaginary",     T_IMAGINARY},
-		{"_Noreturn",      T_NORETURN},
-		{"_Static_assert", TSTATIC_ASSERT},
-		{"_Thread_local",  TTHREAD_LOCAL},
-		{"__alignof__",    TALIGNOF},
-		{"__asm",          T__ASM__},
-		{"__asm__",        T__ASM__},
-		{"__attribute__",  T__ATTRIBUTE__},
-		{"__inline",       TINLINE},
-		{"__inline__",     TINLINE},
-		{"__signed",       TSIGNED},
-		{"__signed__",     TSIGNED},
-		{"__thread",       TTHREAD_LOCAL},
-		{"__typeof",       TTYPEOF},
-		{"__typeof__",     TTYPEOF},
-		{"__volatile__",   TVOLATILE},
-		{"alignas",        TALIGNAS},
-		{"alignof",        TALIGNOF},
-		{"auto",           TAUTO},
-		{"bool",           TBOOL},
-		{"break",          TBREAK},
-		{"case",           TCASE},
-		{"char",           TCHAR},
-		{"const",          TCONST},
-		{"constexpr",      TCONSTEXPR},
-		{"continue",       TCONTINUE},
-		{"default",        TDEFAULT},
-		{"do",             TDO},
-		{"double",         TDOUBLE},
-		{"else",           TELSE},
-		{"enum",           TENUM},
-		{"extern",         TEXTERN},
-		{"false",          TFALSE},
-		{"float",          TFLOAT},
-		{"for",            TFOR},
-		{"goto",           TGOTO},
-		{"if",             TIF},
-		{"inline",         TINLINE},
-		{"int",            TINT},
-		{"long",           TLONG},
-		{"nullptr",        TNULLPTR},
-		{"register",       TREGISTER},
-		{"restrict",       TRESTRICT},
-		{"return",         TRETURN},
-		{"short",          TSHORT},
-		{"signed",         TSIGNED},
-		{"sizeof",         TSIZEOF},
-		{"static",         TSTATIC},
-		{"static_assert",  TSTATIC_ASSERT},
-		{"struct",         TSTRUCT},
-		{"switch",         TSWITCH},
-		{"thread_local",   TTHREAD_LOCAL},
-		{"true",           TTRUE},
-		{"typedef",        TTYPEDEF},
-		{"typeof",         TTYPEOF},
-		{"typeof_unqual",  TTYPEOF_UNQUAL},
-		{"union",          TUNION},
-		{"unsigned",       TUNSIGNED},
-		{"void",           TVOID},
-		{"volatile",       TVOLATILE},
-		{"while",          TWHILE},
-	};
-	size_t low = 0, high = LEN(keywords), mid;
-	int cmp;
-
-	while (low < high) {
-		mid = (low + high) / 2;
-		cmp = strcmp(tok->lit, keywords[mid].name);
-		if (cmp == 0) {
-			free(tok->lit);
-			tok->kind = keywords[mid].value;
-			tok->lit = NULL;
+	const char *llit, *rlit;
+	size_t llen, rlen;
+	char *buf;
+
+	llit = l->lit ? l->lit : tokstr[l->kind];
+	rlit = r->lit ? r->lit : tokstr[r->kind];
+	llen = strlen(llit);
+	rlen = strlen(rlit);
+	/* leave room for the scanner to terminate the token */
+	buf = arenaalloc(&litarena, llen + rlen + 1);
+	stats.litbytes += llen + rlen + 1;
+	memcpy(buf, llit, llen);
+	memcpy(buf + llen, rlit, rlen);
+	if (!scantoken(buf, llen + rlen, l))
+		error(&l->loc, "pasting '%s' and '%s' does not give a valid preprocessing token", llit, rlit);
+	l->hide = false;
+}
+
+/* substitute the arguments of a macro containing '##', and concatenate the operands */
+static void
+pastemacro(struct macro *m)
+{
+	static struct array buf;
+	struct token *t, *end, *op, *t0;
+	size_t i, n, start;
+	bool paste, space;
+
+	buf.len = 0;
+	start = 0;
+	paste = false;
+	for (t = m->token, end = t + m->ntoken; t != end; ++t) {
+		if (t->kind == THASHHASH) {
+			paste = true;
+			continue;
+		}
+		space = t->space;
+		op = t;
+		n = 1;
+		switch (t->kind) {
+		case TPARAMSTR:
+			op = &m->arg[t->param].str;
+			break;
+		case TPARAM:
+			i = t->param;
+			if (paste || t + 1 != end && t[1].kind == THASHHASH) {
+				op = m->arg[i].raw;
+				n = m->arg[i].nraw;
+			} else {
+				op = m->arg[i].token;
+				n = m->arg[i].ntoken;
+			}
 			break;
 		}
-		if (cmp < 0)
-			high = mid;
-		else
-			low = mid + 1;
+		/* an empty operand acts as a placemarker, leaving the other one as is */
+		if (paste && buf.len > start) {
+			if (n > 0) {
+				pastetoken((struct token *)((char *)buf.val + buf.len) - 1, op);
+				arrayaddbuf(&buf, op + 1, (n - 1) * sizeof(*op));
+			}
+		} else {
+			if (!paste)
+				start = buf.len;
+			if (n > 0) {
+				t0 = arrayadd(&buf, n * sizeof(*op));
+				memcpy(t0, op, n * sizeof(*op));
+				t0->space = space;
+			}
+		}
+		paste = false;
 	}
+	m->pasted = argsave(buf.val, buf.len);
+	m->npasted = buf.len / sizeof(*op);
+}
+
+static void
+keyword(struct token *tok)
+{
+	tok->kind = atomof(tok->lit)->kind;
+	if (tok->kind != TIDENT)
+		tok->lit = NULL;
 }
 
 void
@@ -633,6 +2100,7 @@ next(void)
 	do t = rawnext();
 	while (expand(t) || t->kind == TNEWLINE && !(ppflags & PPNEWLINE));
 	tok = *t;
+	++stats.output;
 	if (tok.kind == TIDENT)
 		keyword(&tok);
 }
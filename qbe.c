@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -118,7 +119,7 @@ mkblock(char *name)
 	static unsigned id;
 	struct block *b;
 
-	b = xmalloc(sizeof(*b));
+	b = arenaalloc(funcarena, sizeof(*b));
 	b->label.kind = VALUE_LABEL;
 	b->label.u.name = name;
 	b->label.id = ++id;
@@ -136,7 +137,7 @@ mkglobal(struct decl *d)
 	static unsigned id;
 	struct value *v;
 
-	v = xmalloc(sizeof(*v));
+	v = arenaalloc(&tuarena, sizeof(*v));
 	v->kind = VALUE_GLOBAL;
 	if (d->kind == DECLOBJECT && d->u.obj.storage == SDTHREAD)
 		v->kind |= VALUE_THREAD;
@@ -151,14 +152,40 @@ mkglobal(struct decl *d)
 	return v;
 }
 
+/*
+Constants are shared. Small integers come from a static table, and
+other constants are looked up in a small direct-mapped cache of
+recently created ones, which is cleared when funcarena is released.
+*/
+static struct value *consts[256];
+
+static struct value **
+constslot(int kind, uint_least64_t bits)
+{
+	bits = (bits ^ kind) * 0x9e3779b97f4a7c15;
+	return &consts[bits >> 56];
+}
+
 struct value *
 mkintconst(unsigned long long n)
 {
-	struct value *v;
+	static struct value ints[256];
+	struct value *v, **c;
 
-	v = xmalloc(sizeof(*v));
+	if (n < LEN(ints)) {
+		v = &ints[n];
+		v->kind = VALUE_INTCONST;
+		v->u.i = n;
+		return v;
+	}
+	c = constslot(VALUE_INTCONST, n);
+	v = *c;
+	if (v && v->kind == VALUE_INTCONST && v->u.i == n)
+		return v;
+	v = arenaalloc(funcarena, sizeof(*v));
 	v->kind = VALUE_INTCONST;
 	v->u.i = n;
+	*c = v;
 
 	return v;
 }
@@ -166,11 +193,18 @@ mkintconst(unsigned long long n)
 static struct value *
 mkfltconst(int kind, double n)
 {
-	struct value *v;
+	struct value *v, **c;
+	uint_least64_t bits;
 
-	v = xmalloc(sizeof(*v));
+	memcpy(&bits, &n, sizeof(bits));
+	c = constslot(kind, bits);
+	v = *c;
+	if (v && v->kind == kind && memcmp(&v->u.f, &n, sizeof(n)) == 0)
+		return v;
+	v = arenaalloc(funcarena, sizeof(*v));
 	v->kind = kind;
 	v->u.f = n;
+	*c = v;
 
 	return v;
 }
@@ -228,7 +262,7 @@ mkinst(struct func *f, int op, int class, struct value *arg0, struct value *arg1
 {
 	struct inst *inst;
 
-	inst = xmalloc(sizeof(*inst));
+	inst = arenaalloc(funcarena, sizeof(*inst));
 	inst->kind = op;
 	inst->class = class;
 	inst->arg[0] = arg0;
@@ -505,8 +539,9 @@ mkfunc(struct decl *decl, char *name, struct type *t, struct scope *s)
 	struct func *f;
 	struct decl *d;
 	struct value *v;
+	size_t i;
 
-	f = xmalloc(sizeof(*f));
+	f = arenaalloc(funcarena, sizeof(*f));
 	f->decl = decl;
 	f->name = name;
 	f->type = t;
@@ -516,8 +551,9 @@ mkfunc(struct decl *decl, char *name, struct type *t, struct scope *s)
 	emittype(t->base);
 
 	/* allocate space for parameters */
-	f->paramtemps = xreallocarray(NULL, t->u.func.nparam, sizeof *f->paramtemps);
-	for (d = t->u.func.params, v = f->paramtemps; d; d = d->next, ++v) {
+	f->paramtemps = arenaalloc(funcarena, t->u.func.nparam * sizeof *f->paramtemps);
+	for (i = 0, v = f->paramtemps; i < t->u.func.nparam; ++i, ++v) {
+		d = t->u.func.params[i];
 		emittype(d->type);
 		functemp(f, v);
 		if(!d->name)
@@ -531,7 +567,7 @@ mkfunc(struct decl *decl, char *name, struct type *t, struct scope *s)
 	}
 
 	t = mkarraytype(&typechar, QUALCONST, strlen(name) + 1);
-	d = mkdecl("__func__", DECLOBJECT, t, QUALNONE, LINKNONE);
+	d = mkdecl(intern("__func__", 8)->name, DECLOBJECT, t, QUALNONE, LINKNONE);
 	d->u.obj.storage = SDSTATIC;
 	d->value = mkglobal(d);
 	scopeputdecl(s, d);
@@ -546,17 +582,12 @@ void
 delfunc(struct func *f)
 {
 	struct block *b;
-	struct inst **inst;
 
-	while (b = f->start) {
-		f->start = b->next;
-		arrayforeach (&b->insts, inst)
-			free(*inst);
+	/* everything else is in funcarena */
+	for (b = f->start; b; b = b->next)
 		free(b->insts.val);
-		free(b);
-	}
-	mapfree(&f->gotos, free);
-	free(f);
+	mapfree(&f->gotos, NULL);
+	memset(consts, 0, sizeof(consts));
 }
 
 struct type *
@@ -633,13 +664,10 @@ funcgoto(struct func *f, char *name)
 {
 	void **entry;
 	struct gotolabel *g;
-	struct mapkey key;
-
-	mapkey(&key, name, strlen(name));
-	entry = mapput(&f->gotos, &key);
+	entry = mapput(&f->gotos, &atomof(name)->key);
 	g = *entry;
 	if (!g) {
-		g = xmalloc(sizeof(*g));
+		g = arenaalloc(funcarena, sizeof(*g));
 		g->label = mkblock(name);
 		*entry = g;
 	}
@@ -675,8 +703,8 @@ funclval(struct func *f, struct expr *e)
 		lval.addr = d->value;
 		break;
 	case EXPRCOMPOUND:
-		if (e->toeval)
-			funcexpr(f, e->toeval);
+		if (e->u.compound.toeval)
+			funcexpr(f, e->u.compound.toeval);
 		d = e->u.compound.decl;
 		funcinit(f, d, e->u.compound.init, true);
 		lval.addr = d->value;
@@ -745,8 +773,9 @@ funcexpr(struct func *f, struct expr *e)
 		v = funcstore(f, e->type, e->qual, lval, v);
 		return e->u.incdec.post ? l : v;
 	case EXPRCALL:
-		argvals = xreallocarray(NULL, e->u.call.nargs, sizeof(argvals[0]));
-		for (arg = e->u.call.args, i = 0; arg; arg = arg->next, ++i) {
+		argvals = arenaalloc(funcarena, e->u.call.nargs * sizeof(argvals[0]));
+		for (i = 0; i < e->u.call.nargs; ++i) {
+			arg = e->u.call.args[i];
 			emittype(arg->type);
 			argvals[i] = funcexpr(f, arg);
 		}
@@ -754,10 +783,10 @@ funcexpr(struct func *f, struct expr *e)
 		emittype(t);
 		v = funcinst(f, ICALL, qbetype(t).base, funcexpr(f, e->base), t->value);
 		functype = e->base->type->base;
-		for (arg = e->u.call.args, i = 0; arg; arg = arg->next, ++i) {
+		for (i = 0; i < e->u.call.nargs; ++i) {
 			if (functype->u.func.isvararg && i == functype->u.func.nparam)
 				funcinst(f, IVARARG, 0, NULL, NULL);
-			t = arg->type;
+			t = e->u.call.args[i]->type;
 			funcinst(f, IARG, qbetype(t).base, argvals[i], t->value);
 		}
 		e = e->base;
@@ -782,8 +811,8 @@ funcexpr(struct func *f, struct expr *e)
 		fatal("internal error; unknown unary expression");
 		break;
 	case EXPRCAST:
-		if (e->toeval)
-			funcexpr(f, e->toeval);
+		if (e->u.cast.toeval)
+			funcexpr(f, e->u.cast.toeval);
 		l = funcexpr(f, e->base);
 		return convert(f, e->type, e->base->type, l);
 	case EXPRBINARY:
@@ -917,9 +946,8 @@ funcexpr(struct func *f, struct expr *e)
 		}
 		return r;
 	case EXPRCOMMA:
-		for (e = e->base; e->next; e = e->next)
-			funcexpr(f, e);
-		return funcexpr(f, e);
+		funcexpr(f, e->u.comma.l);
+		return funcexpr(f, e->u.comma.r);
 	case EXPRBUILTIN:
 		switch (e->u.builtin.kind) {
 		case BUILTINVASTART:
@@ -927,8 +955,8 @@ funcexpr(struct func *f, struct expr *e)
 			funcinst(f, IVASTART, 0, l, NULL);
 			break;
 		case BUILTINVAARG:
-			if (e->toeval)
-				funcexpr(f, e->toeval);
+			if (e->u.builtin.toeval)
+				funcexpr(f, e->u.builtin.toeval);
 			/* https://todo.sr.ht/~mcf/cproc/52 */
 			if (!(e->type->prop & PROPSCALAR))
 				error(&tok.loc, "va_arg with non-scalar type is not yet supported");
@@ -1055,6 +1083,7 @@ casesearch(struct func *f, int class, struct value *v, struct switchcase *c, str
 	casesearch(f, class, v, c->node.child[0], defaultlabel);
 	funclabel(f, label[2]);
 	casesearch(f, class, v, c->node.child[1], defaultlabel);
+	free(c);
 }
 
 void
@@ -1127,17 +1156,18 @@ static void
 emittype(struct type *t)
 {
 	static unsigned id;
-	struct member *m, *other;
+	struct member *m, *other, *end;
 	struct type *sub;
 	unsigned long long off;
 
 	if (t->value || t->kind != TYPESTRUCT && t->kind != TYPEUNION)
 		return;
-	t->value = xmalloc(sizeof(*t->value));
+	t->value = arenaalloc(&tuarena, sizeof(*t->value));
 	t->value->kind = VALUE_TYPE;
 	t->value->u.name = t->u.structunion.tag;
 	t->value->id = ++id;
-	for (m = t->u.structunion.members; m; m = m->next) {
+	end = t->u.structunion.members + t->u.structunion.nmember;
+	for (m = t->u.structunion.members; m != end; ++m) {
 		for (sub = m->type; sub->kind == TYPEARRAY; sub = sub->base)
 			;
 		emittype(sub);
@@ -1149,10 +1179,10 @@ emittype(struct type *t)
 		return;
 	}
 	fputs(" = { ", stdout);
-	for (m = t->u.structunion.members, off = 0; m;) {
+	for (m = t->u.structunion.members, off = 0; m != end;) {
 		if (t->kind == TYPESTRUCT) {
 			/* look for a subsequent member with a larger storage unit */
-			for (other = m->next; other; other = other->next) {
+			for (other = m + 1; other != end; ++other) {
 				if (other->offset >= ALIGNUP(m->offset + 1, 8))
 					break;
 				if (other->offset <= m->offset)
@@ -1170,11 +1200,11 @@ emittype(struct type *t)
 		if (t->kind == TYPESTRUCT) {
 			fputs(", ", stdout);
 			/* skip subsequent members contained within the same storage unit */
-			do m = m->next;
-			while (m && m->offset < off);
+			do ++m;
+			while (m != end && m->offset < off);
 		} else {
 			fputs(" } ", stdout);
-			m = m->next;
+			++m;
 		}
 	}
 	puts("}");
@@ -1273,6 +1303,7 @@ emitfunc(struct func *f, bool global)
 	struct inst **inst, **instend;
 	struct decl *p;
 	struct value *v;
+	size_t i;
 
 	if (f->end->jump.kind == JUMP_NONE) {
 		v = NULL;
@@ -1290,15 +1321,16 @@ emitfunc(struct func *f, bool global)
 	}
 	emitname(f->decl->value);
 	putchar('(');
-	for (p = f->type->u.func.params, v = f->paramtemps; p; p = p->next, ++v) {
-		if (p != f->type->u.func.params)
+	for (i = 0, v = f->paramtemps; i < f->type->u.func.nparam; ++i, ++v) {
+		if (i > 0)
 			fputs(", ", stdout);
+		p = f->type->u.func.params[i];
 		emitclass(qbetype(p->type).base, p->type->value);
 		putchar(' ');
 		emitname(v);
 	}
 	if (f->type->u.func.isvararg) {
-		if (f->type->u.func.params)
+		if (f->type->u.func.nparam > 0)
 			fputs(", ", stdout);
 		fputs("...", stdout);
 	}
@@ -1,75 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "util.h"
 #include "cc.h"
 
-struct buffer {
-	unsigned char *str;
-	size_t len, cap;
-};
-
 struct scanner {
 	int chr;
 	bool usebuf;
 	bool sawspace;
+	/* the last token was a newline, or no token was scanned */
+	bool newline;
 	FILE *file;
+	/* contents of the input, and the position of the next character */
+	unsigned char *pos, *end;
+	/* position of the current character, and of the start of the token */
+	unsigned char *mark, *start;
+	unsigned char *data;
+	size_t size;
 	struct location loc;
-	struct buffer buf;
+	/* name of the input, unaffected by #line */
+	const char *name;
+	/* number of inputs on the stack, including this one */
+	size_t depth;
 	struct scanner *next;
 };
 
 static struct scanner *scanner;
+/* scanning a group skipped by conditional inclusion */
+static bool skipping;
 
 static void
-bufadd(struct buffer *b, int c)
+nextchar(struct scanner *s)
 {
-	if (b->len >= b->cap) {
-		b->cap = b->cap ? b->cap * 2 : 1<<8;
-		b->str = xreallocarray(b->str, b->cap, 1);
+	for (;;) {
+		s->mark = s->pos;
+		if (s->pos == s->end) {
+			s->chr = EOF;
+			++s->loc.col;
+			break;
+		}
+		s->chr = *s->pos++;
+		if (s->chr == '\n') {
+			++s->loc.line, s->loc.col = 0;
+			break;
+		}
+		++s->loc.col;
+		/* line splice */
+		if (s->chr != '\\' || s->pos == s->end || *s->pos != '\n')
+			break;
+		++s->pos;
+		++s->loc.line, s->loc.col = 0;
 	}
-	b->str[b->len++] = c;
 }
 
-static char *
-bufget(struct buffer *b)
+/*
+The following functions find the end of runs of characters in the
+input. They examine eight bytes at a time, classifying all of them at
+once with arithmetic on a 64-bit word, and finish byte by byte.
+*/
+#define ONES  0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+
+static unsigned long long
+load(const unsigned char *p)
 {
-	char *s;
+	unsigned long long x;
 
-	bufadd(b, '\0');
-	s = xmalloc(b->len);
-	memcpy(s, b->str, b->len);
-	b->len = 0;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
 
-	return s;
+/* set the high bit of each byte of x that is equal to c */
+static unsigned long long
+bytesequal(unsigned long long x, int c)
+{
+	x ^= ONES * c;
+	return ~((x & ~HIGHS) + ~HIGHS | x) & HIGHS;
 }
 
-static void
-nextchar(struct scanner *s)
+/* set the high bit of each byte of x in the ASCII range [lo, hi] */
+static unsigned long long
+bytesinrange(unsigned long long x, int lo, int hi)
 {
-	int c;
+	unsigned long long y;
 
-	if (s->usebuf)
-		bufadd(&s->buf, s->chr);
-	for (;;) {
-		s->chr = getc(s->file);
-		if (s->chr == '\n') {
-			++s->loc.line, s->loc.col = 0;
+	y = x & ~HIGHS;
+	return (y + ONES * (128 - lo) & ~(y + ONES * (127 - hi))) & ~x & HIGHS;
+}
+
+static unsigned char *
+spaceend(unsigned char *p, unsigned char *end)
+{
+	unsigned long long x, m;
+
+	for (; end - p >= 8; p += 8) {
+		x = load(p);
+		m = bytesequal(x, ' ') | bytesequal(x, '\t') | bytesequal(x, '\f') | bytesequal(x, '\v');
+		if (m != HIGHS)
 			break;
-		}
-		++s->loc.col;
-		if (s->chr != '\\')
+	}
+	while (p != end && (*p == ' ' || *p == '\t' || *p == '\f' || *p == '\v'))
+		++p;
+	return p;
+}
+
+static unsigned char *
+identend(unsigned char *p, unsigned char *end)
+{
+	unsigned long long x, m;
+
+	for (; end - p >= 8; p += 8) {
+		x = load(p);
+		/* setting bit 5 maps upper case letters to lower case */
+		m = bytesinrange(x | ONES * 0x20, 'a', 'z') | bytesinrange(x, '0', '9') | bytesequal(x, '_');
+		if (m != HIGHS)
 			break;
-		c = getc(s->file);
-		if (c != '\n') {
-			ungetc(c, s->file);
+	}
+	while (p != end && (isalnum(*p) || *p == '_'))
+		++p;
+	return p;
+}
+
+static unsigned char *
+stringend(unsigned char *p, unsigned char *end)
+{
+	unsigned long long x;
+
+	for (; end - p >= 8; p += 8) {
+		x = load(p);
+		if (bytesequal(x, '"') | bytesequal(x, '\\') | bytesequal(x, '\n'))
 			break;
-		}
-		++s->loc.line, s->loc.col = 0;
 	}
+	while (p != end && *p != '"' && *p != '\\' && *p != '\n')
+		++p;
+	return p;
+}
+
+/*
+consume the characters after the current one up to p, which must
+not contain any newlines, leaving the last one as the current character
+*/
+static void
+skiprun(struct scanner *s, unsigned char *p)
+{
+	size_t n;
+
+	n = p - s->pos;
+	if (n == 0)
+		return;
+	s->chr = p[-1];
+	s->mark = p - 1;
+	s->pos = p;
+	s->loc.col += n;
+}
+
+/* skip the input up to p, updating the location from the number of newlines */
+static void
+skipto(struct scanner *s, unsigned char *p)
+{
+	unsigned char *q;
+	unsigned long long m;
+	size_t lines;
+
+	lines = 0;
+	for (q = s->pos; p - q >= 8; q += 8) {
+		m = bytesequal(load(q), '\n');
+		/* sum the flags into the most significant byte */
+		lines += (m >> 7) * ONES >> 56;
+	}
+	for (; q != p; ++q)
+		lines += *q == '\n';
+	if (lines > 0) {
+		for (q = p; q[-1] != '\n'; --q)
+			;
+		s->loc.line += lines;
+		s->loc.col = p - q;
+	} else {
+		s->loc.col += p - s->pos;
+	}
+	s->pos = p;
+}
+
+/* look at the character after the current one without consuming it */
+static int
+peekchar(struct scanner *s)
+{
+	unsigned char *p;
+
+	for (p = s->pos; s->end - p >= 2 && p[0] == '\\' && p[1] == '\n'; p += 2)
+		;
+	return p == s->end ? EOF : *p;
 }
 
 static int
@@ -123,8 +253,10 @@ static int
 ident(struct scanner *s)
 {
 	s->usebuf = true;
-	while (isalnum(s->chr) || s->chr == '_')
+	while (isalnum(s->chr) || s->chr == '_') {
+		skiprun(s, identend(s->pos, s->end));
 		nextchar(s);
+	}
 
 	return TIDENT;
 }
@@ -175,10 +307,10 @@ escape(struct scanner *s)
 	nextchar(s);
 	if (s->chr == 'x') {
 		nextchar(s);
-		if (!isxdigit(s->chr))
+		if (!isxdigit(s->chr) && !skipping)
 			error(&s->loc, "invalid hexadecimal escape sequence");
-		do nextchar(s);
-		while (isxdigit(s->chr));
+		while (isxdigit(s->chr))
+			nextchar(s);
 	} else if (isodigit(s->chr)) {
 		nextchar(s);
 		if (isodigit(s->chr)) {
@@ -188,7 +320,7 @@ escape(struct scanner *s)
 		}
 	} else if (strchr("'\"?\\abfnrtv", s->chr)) {
 		nextchar(s);
-	} else {
+	} else if (!skipping) {
 		error(&s->loc, "invalid escape sequence");
 	}
 }
@@ -207,8 +339,13 @@ charconst(struct scanner *s)
 			nextchar(s);
 			return TCHARCONST;
 		case '\n':
+			/* a skipped group need not consist of valid tokens */
+			if (skipping)
+				return TCHARCONST;
 			error(&s->loc, "newline in character constant");
 		case EOF:
+			if (skipping)
+				return TCHARCONST;
 			error(&s->loc, "EOF in character constant");
 		default:
 			nextchar(s);
@@ -231,10 +368,15 @@ stringlit(struct scanner *s)
 			nextchar(s);
 			return TSTRINGLIT;
 		case '\n':
+			if (skipping)
+				return TSTRINGLIT;
 			error(&s->loc, "newline in string literal");
 		case EOF:
+			if (skipping)
+				return TSTRINGLIT;
 			error(&s->loc, "EOF in string literal");
 		default:
+			skiprun(s, stringend(s->pos, s->end));
 			nextchar(s);
 			break;
 		}
@@ -244,21 +386,32 @@ stringlit(struct scanner *s)
 static bool
 comment(struct scanner *s)
 {
-	int last;
+	unsigned char *p, *q;
 
 	switch (s->chr) {
 	case '/':  /* C++-style comment */
-		do nextchar(s);
-		while (s->chr != '\n' && s->chr != EOF);
+		p = s->pos;
+		/* the comment continues past spliced lines */
+		while ((p = memchr(p, '\n', s->end - p)) && p[-1] == '\\')
+			++p;
+		skipto(s, p ? p : s->end);
+		nextchar(s);
 		break;
 	case '*':  /* C-style comment */
-		nextchar(s);
-		do {
-			last = s->chr;
-			nextchar(s);
-			if (s->chr == EOF)
+		for (p = s->pos;; p = q) {
+			p = memchr(p, '*', s->end - p);
+			if (!p) {
+				skipto(s, s->end);
+				nextchar(s);
 				error(&s->loc, "EOF in comment");
-		} while (last != '*' || s->chr != '/');
+			}
+			for (q = p + 1; s->end - q >= 2 && q[0] == '\\' && q[1] == '\n'; q += 2)
+				;
+			if (q != s->end && *q == '/')
+				break;
+		}
+		skipto(s, q);
+		nextchar(s);
 		nextchar(s);
 		break;
 	default:
@@ -272,16 +425,17 @@ static int
 scankind(struct scanner *s, struct location *loc)
 {
 	enum tokenkind tok;
-	struct location oldloc;
 
 again:
 	*loc = s->loc;
+	s->start = s->mark;
 	switch (s->chr) {
 	case ' ':
 	case '\t':
 	case '\f':
 	case '\v':
 		s->sawspace = true;
+		skiprun(s, spaceend(s->pos, s->end));
 		nextchar(s);
 		goto again;
 	case '!':
@@ -348,20 +502,11 @@ again:
 		return TRBRACE;
 	case '.':
 		nextchar(s);
-		if (isdigit(s->chr)) {
-			bufadd(&s->buf, '.');
+		if (isdigit(s->chr))
 			return number(s);
-		}
-		if (s->chr != '.')
+		if (s->chr != '.' || peekchar(s) != '.')
 			return TPERIOD;
-		oldloc = s->loc;
 		nextchar(s);
-		if (s->chr != '.') {
-			ungetc(s->chr, s->file);
-			s->loc = oldloc;
-			s->chr = '.';
-			return TPERIOD;
-		}
 		nextchar(s);
 		return TELLIPSIS;
 	case '~':
@@ -387,7 +532,7 @@ again:
 	case 'u':
 		s->usebuf = true;
 		nextchar(s);
-		if (s->buf.str[0] == 'u' && s->chr == '8')
+		if (*s->start == 'u' && s->chr == '8')
 			nextchar(s);
 		switch (s->chr) {
 		case '\'': return charconst(s);
@@ -407,6 +552,66 @@ again:
 	}
 }
 
+/*
+Token literals point into the input buffer, and are terminated in place
+by overwriting the character following them, which has already been
+read. So, the buffer must be writable, have room for one byte past the
+end, and is kept for the rest of the compilation. If that character
+begins another token with a literal, such as in "a""b", the literal is
+copied instead.
+*/
+
+/* read the remaining contents of a stream into a growable buffer */
+static void
+scanread(struct scanner *s, FILE *file)
+{
+	struct array a = {0};
+	size_t n;
+
+	/* the final read leaves room for the terminator */
+	do {
+		n = fread(arrayadd(&a, 1<<16), 1, 1<<16, file);
+		a.len -= (1<<16) - n;
+	} while (n > 0);
+	if (ferror(file))
+		fatal("read %s:", s->loc.file);
+	s->data = a.val;
+	s->size = a.len;
+}
+
+/* map an open file into memory, falling back to reading it */
+static void
+scanmap(struct scanner *s, int fd)
+{
+	struct stat st;
+	void *data;
+
+	if (fstat(fd, &st) != 0)
+		fatal("stat %s:", s->loc.file);
+	/* the zero-filled remainder of the last page holds the terminator */
+	if (S_ISREG(st.st_mode) && st.st_size % sysconf(_SC_PAGESIZE) != 0) {
+		data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			s->data = data;
+			s->size = st.st_size;
+			close(fd);
+			return;
+		}
+	}
+	s->file = fdopen(fd, "r");
+	if (!s->file)
+		fatal("fdopen %s:", s->loc.file);
+	scanread(s, s->file);
+}
+
+static void
+scanstart(struct scanner *s)
+{
+	s->pos = s->data;
+	s->end = s->data + s->size;
+	nextchar(s);
+}
+
 void
 scanfrom(const char *name, FILE *file)
 {
@@ -414,42 +619,153 @@ scanfrom(const char *name, FILE *file)
 
 	s = xmalloc(sizeof(*s));
 	s->file = file;
-	s->buf.str = NULL;
-	s->buf.len = 0;
-	s->buf.cap = 0;
+	s->data = NULL;
+	s->size = 0;
 	s->usebuf = false;
+	s->newline = true;
+	s->name = name;
 	s->loc.file = name;
 	s->loc.line = 1;
 	s->loc.col = 0;
+	s->depth = scanner ? scanner->depth + 1 : 1;
 	s->next = scanner;
-	if (file)
-		nextchar(s);
+	if (file) {
+		scanread(s, file);
+		scanstart(s);
+	}
 	scanner = s;
 }
 
+/* scan from a buffer, which must have room for one byte past its end */
+void
+scanbuffer(const char *name, char *data, size_t len)
+{
+	scanfrom(name, NULL);
+	scanner->data = (unsigned char *)data;
+	scanner->size = len;
+	scanstart(scanner);
+}
+
 void
 scanopen(void)
 {
-	if (!scanner->file) {
-		scanner->file = fopen(scanner->loc.file, "r");
-		if (!scanner->file)
+	int fd;
+
+	if (!scanner->file && !scanner->data) {
+		fd = open(scanner->loc.file, O_RDONLY);
+		if (fd < 0)
 			fatal("open %s:", scanner->loc.file);
-		nextchar(scanner);
+		scanmap(scanner, fd);
+		scanstart(scanner);
 	}
 }
 
+const char *
+scanname(void)
+{
+	return scanner->name;
+}
+
+size_t
+scandepth(void)
+{
+	return scanner->depth;
+}
+
+/* check if only white space and comments remain in the current file */
+bool
+scanateof(void)
+{
+	struct scanner s;
+	struct location loc;
+	enum tokenkind kind;
+
+	s = *scanner;
+	do kind = scankind(&s, &loc);
+	while (kind == TNEWLINE);
+	return kind == TEOF;
+}
+
+/* start scanning an included file, unless it can't be opened */
+bool
+scaninclude(const char *name)
+{
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return false;
+	scanfrom(name, NULL);
+	scanmap(scanner, fd);
+	scanstart(scanner);
+	return true;
+}
+
 void
 scansetloc(struct location loc)
 {
 	scanner->loc = loc;
 }
 
+static struct scanner *
+scanclose(struct scanner *s)
+{
+	struct scanner *next;
+
+	if (s->file)
+		fclose(s->file);
+	next = s->next;
+	free(s);
+	return next;
+}
+
+/* copy a token containing line splices, removing them */
+static char *
+splicedlit(unsigned char *pos, unsigned char *end)
+{
+	char *lit, *dst;
+
+	lit = dst = xmalloc(end - pos + 1);
+	while (pos != end) {
+		if (pos[0] == '\\' && pos[1] == '\n')
+			pos += 2;
+		else
+			*dst++ = *pos++;
+	}
+	*dst = '\0';
+
+	return lit;
+}
+
+/* set the literal of the token that was just scanned */
 static void
-scanclose(void)
+scanlit(struct scanner *s, struct token *t)
 {
-	fclose(scanner->file);
-	free(scanner->buf.str);
-	free(scanner);
+	unsigned char *start, *end;
+
+	if (!s->usebuf) {
+		t->lit = NULL;
+		return;
+	}
+	start = s->start;
+	end = s->mark;
+	/* tokens never contain newlines other than in line splices */
+	if (memchr(start, '\n', end - start)) {
+		start = (unsigned char *)splicedlit(start, end);
+		end = start + strlen((char *)start);
+	}
+	if (t->kind == TIDENT) {
+		t->lit = intern((char *)start, end - start)->name;
+	} else if (s->chr == EOF || s->chr != '\0' && strchr(" \t\f\v\n!#%&*+-/<=>^|[](){}~?:;,", s->chr)) {
+		/* the next character does not begin a token with a literal */
+		*end = '\0';
+		t->lit = (char *)start;
+	} else {
+		t->lit = xmalloc(end - start + 1);
+		memcpy(t->lit, start, end - start);
+		t->lit[end - start] = '\0';
+	}
+	s->usebuf = false;
 }
 
 void
@@ -460,16 +776,48 @@ scan(struct token *t)
 		t->kind = scankind(scanner, &t->loc);
 		if (t->kind != TEOF || !scanner->next)
 			break;
-		scanclose();
-		scanner = scanner->next;
+		/* a file that does not end with a newline still ends its last line */
+		if (!scanner->newline) {
+			t->kind = TNEWLINE;
+			break;
+		}
+		scanner = scanclose(scanner);
 		scanopen();
 	}
-	if (scanner->usebuf) {
-		t->lit = bufget(&scanner->buf);
-		scanner->usebuf = false;
-	} else {
-		t->lit = NULL;
-	}
+	scanner->newline = t->kind == TNEWLINE;
+	scanlit(scanner, t);
 	t->space = scanner->sawspace;
 	t->hide = false;
 }
+
+/* scan a token in a group skipped by conditional inclusion */
+void
+scanskipped(struct token *t)
+{
+	skipping = true;
+	scan(t);
+	skipping = false;
+}
+
+/*
+scan a buffer that must contain exactly one token, keeping the location
+of t, and return whether it did
+*/
+bool
+scantoken(char *data, size_t len, struct token *t)
+{
+	struct scanner s;
+	struct location loc;
+
+	s.usebuf = false;
+	s.file = NULL;
+	s.data = (unsigned char *)data;
+	s.size = len;
+	s.loc = t->loc;
+	scanstart(&s);
+	t->kind = scankind(&s, &loc);
+	if (t->kind == TEOF)
+		return false;
+	scanlit(&s, t);
+	return scankind(&s, &loc) == TEOF;
+}
@@ -1,11 +1,34 @@
+#include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include "util.h"
 #include "cc.h"
 
+/*
+Each atom has a stack of the declarations (and another of the tags)
+with its name in the open scopes, innermost first, so a lookup only
+needs to look at the top of the stack. When a scope is deleted, its
+bindings are popped off the stacks of their atoms.
+*/
+struct binding {
+	struct scope *scope;
+	void *val;
+	/* top of the stack this binding belongs to */
+	struct binding **head;
+	/* binding of the same name in an enclosing scope */
+	struct binding *shadow;
+	/* next binding in the same scope */
+	struct binding *next;
+};
+
 struct scope filescope;
 
+/* deleted scopes and bindings, for reuse */
+static struct scope *freescopes;
+static struct binding *freebindings;
+
 void
 scopeinit(void)
 {
@@ -26,9 +49,11 @@ scopeinit(void)
 	static struct decl valist;
 	struct decl *d;
 
-	for (d = builtins; d < builtins + LEN(builtins); ++d)
+	for (d = builtins; d < builtins + LEN(builtins); ++d) {
+		d->name = intern(d->name, strlen(d->name))->name;
 		scopeputdecl(&filescope, d);
-	valist.name = "__builtin_va_list";
+	}
+	valist.name = intern("__builtin_va_list", 17)->name;
 	valist.kind = DECLTYPE;
 	valist.type = targ->typevalist;
 	scopeputdecl(&filescope, &valist);
@@ -39,13 +64,18 @@ mkscope(struct scope *parent)
 {
 	struct scope *s;
 
-	s = xmalloc(sizeof(*s));
-	s->decls.len = 0;
-	s->tags.len = 0;
+	if (freescopes) {
+		s = freescopes;
+		freescopes = s->parent;
+	} else {
+		s = xmalloc(sizeof(*s));
+	}
+	s->bindings = NULL;
 	s->breaklabel = parent->breaklabel;
 	s->continuelabel = parent->continuelabel;
 	s->switchcases = parent->switchcases;
 	s->parent = parent;
+	s->depth = parent->depth + 1;
 
 	return s;
 }
@@ -54,64 +84,109 @@ struct scope *
 delscope(struct scope *s)
 {
 	struct scope *parent = s->parent;
-
-	if (s->decls.len)
-		mapfree(&s->decls, NULL);
-	if (s->tags.len)
-		mapfree(&s->tags, NULL);
-	free(s);
+	struct binding *b;
+
+	b = s->bindings;
+	if (b) {
+		for (;;) {
+			/* the scope may have been closed */
+			if (*b->head == b)
+				*b->head = b->shadow;
+			if (!b->next)
+				break;
+			b = b->next;
+		}
+		b->next = freebindings;
+		freebindings = s->bindings;
+	}
+	s->parent = freescopes;
+	freescopes = s;
 
 	return parent;
 }
 
-struct decl *
-scopegetdecl(struct scope *s, const char *name, bool recurse)
+/* remove the bindings of a scope from view until it is reopened */
+struct scope *
+closescope(struct scope *s)
 {
-	struct decl *d;
-	struct mapkey k;
+	struct binding *b;
 
-	mapkey(&k, name, strlen(name));
-	do {
-		d = s->decls.len ? mapget(&s->decls, &k) : NULL;
-		s = s->parent;
-	} while (!d && s && recurse);
+	for (b = s->bindings; b; b = b->next) {
+		assert(*b->head == b);
+		*b->head = b->shadow;
+	}
+	return s->parent;
+}
+
+struct scope *
+reopenscope(struct scope *s)
+{
+	struct binding *b;
 
-	return d;
+	for (b = s->bindings; b; b = b->next) {
+		b->shadow = *b->head;
+		*b->head = b;
+	}
+	return s;
+}
+
+static void *
+lookup(struct binding *b, struct scope *s, bool recurse)
+{
+	while (b && b->scope->depth > s->depth)
+		b = b->shadow;
+	if (!b || !recurse && b->scope != s)
+		return NULL;
+	return b->val;
+}
+
+struct decl *
+scopegetdecl(struct scope *s, const char *name, bool recurse)
+{
+	return lookup(atomof(name)->decl, s, recurse);
 }
 
 struct type *
 scopegettag(struct scope *s, const char *name, bool recurse)
 {
-	struct type *t;
-	struct mapkey k;
-
-	mapkey(&k, name, strlen(name));
-	do {
-		t = s->tags.len ? mapget(&s->tags, &k) : NULL;
-		s = s->parent;
-	} while (!t && s && recurse);
+	return lookup(atomof(name)->tag, s, recurse);
+}
 
-	return t;
+static void
+bind(struct scope *s, struct binding **head, void *val)
+{
+	struct binding *b, **link;
+
+	for (link = head; *link && (*link)->scope->depth > s->depth; link = &(*link)->shadow)
+		;
+	b = *link;
+	if (b && b->scope == s) {
+		b->val = val;
+		return;
+	}
+	if (freebindings) {
+		b = freebindings;
+		freebindings = b->next;
+	} else {
+		b = xmalloc(sizeof(*b));
+	}
+	b->scope = s;
+	b->val = val;
+	b->head = head;
+	b->shadow = *link;
+	*link = b;
+	b->next = s->bindings;
+	s->bindings = b;
 }
 
 void
 scopeputdecl(struct scope *s, struct decl *d)
 {
-	struct mapkey k;
-
-	if (!s->decls.len)
-		mapinit(&s->decls, 32);
-	mapkey(&k, d->name, strlen(d->name));
-	*mapput(&s->decls, &k) = d;
+	bind(s, &atomof(d->name)->decl, d);
 }
 
 void
 scopeputtag(struct scope *s, const char *name, struct type *t)
 {
-	struct mapkey k;
-
-	if (!s->tags.len)
-		mapinit(&s->tags, 32);
-	mapkey(&k, name, strlen(name));
-	*mapput(&s->tags, &k) = t;
+	bind(s, &atomof(name)->tag, t);
 }
@@ -91,7 +91,6 @@ stmt(struct func *f, struct scope *s)
 	default:
 		e = expr(s);
 		v = funcexpr(f, e);
-		delexpr(e);
 		expect(TSEMICOLON, "after expression statement");
 		break;
 
@@ -105,7 +104,6 @@ stmt(struct func *f, struct scope *s)
 		if (!(t->prop & PROPSCALAR))
 			error(&tok.loc, "controlling expression of if statement must have scalar type");
 		v = funcexpr(f, e);
-		delexpr(e);
 		expect(TRPAREN, "after expression");
 
 		b[0] = mkblock("if_true");
@@ -231,7 +229,6 @@ stmt(struct func *f, struct scope *s)
 			if (tok.kind != TSEMICOLON) {
 				e = expr(s);
 				funcexpr(f, e);
-				delexpr(e);
 			}
 			expect(TSEMICOLON, NULL);
 		}
@@ -249,7 +246,6 @@ stmt(struct func *f, struct scope *s)
 				error(&tok.loc, "controlling expression of loop must have scalar type");
 			v = funcexpr(f, e);
 			funcjnz(f, v, t, b[1], b[3]);
-			delexpr(e);
 		}
 		expect(TSEMICOLON, NULL);
 		e = tok.kind == TRPAREN ? NULL : expr(s);
@@ -265,7 +261,6 @@ stmt(struct func *f, struct scope *s)
 		funclabel(f, b[2]);
 		if (e) {
 			funcexpr(f, e);
-			delexpr(e);
 		}
 		funcjmp(f, b[0]);
 		funclabel(f, b[3]);
@@ -299,7 +294,6 @@ stmt(struct func *f, struct scope *s)
 		if (t->base != &typevoid) {
 			e = exprassign(expr(s), t->base);
 			v = funcexpr(f, e);
-			delexpr(e);
 		} else {
 			v = NULL;
 		}
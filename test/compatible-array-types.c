@@ -7,3 +7,5 @@ typedef int T[2];
 static_assert(__builtin_types_compatible_p(const T *, const int (*)[2]));
 */
 static_assert(__builtin_types_compatible_p(float[], float[3]));
+static_assert(_Generic(&"ab", char (*)[4]: 0, char (*)[3]: 1));
+static_assert(_Generic(&"ab", char (*)[3]: 1, char (*)[4]: 0));
@@ -0,0 +1,7 @@
+void g(void);
+long f(int c, long x) {
+	return c ? x * 2 : 1 << 8;
+}
+void h(int c) {
+	c ? (void)0 : g();
+}
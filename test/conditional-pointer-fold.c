@@ -0,0 +1,3 @@
+int *f(int c, int *p, int *q) {
+	return c ? p + 1 : q;
+}
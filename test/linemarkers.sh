@@ -0,0 +1,26 @@
+#!/bin/sh
+# Check that the linemarkers of -E -l are not lost after a line longer
+# than the output buffer, which is written before its end is seen.
+
+: ${CCQBE:=./cproc-qbe}
+
+src=$(mktemp)
+out=$(mktemp)
+trap 'rm "$src" "$out"' EXIT
+
+awk 'BEGIN {
+	print "a"
+	for (i = 0; i < 20; ++i)
+		print ""
+	for (i = 0; i < 40000; ++i)
+		printf "b "
+	print ""
+	print "c"
+}' > "$src"
+
+if $CCQBE -E -l -o "$out" "$src" && sed -n 4p "$out" | grep -q '^# 23 ' && [ "$(sed -n 5p "$out")" = c ] ; then
+	echo "[PASS] $0" >&2
+else
+	echo "[FAIL] $0" >&2
+	exit 1
+fi
@@ -0,0 +1,122 @@
+#!/bin/sh
+# Check that the map stays consistent through many insertions and
+# deletions, and after shrinking: every entry must be reachable from its
+# home slot with the probe distance recorded in its control word, and
+# entries must stay ordered by probe distance.
+
+: ${CC:=cc}
+
+dir=$(mktemp -d)
+trap 'rm -r "$dir"' EXIT
+
+cat > "$dir/map-test.c" <<'END'
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+
+#define N 20000
+
+static char keys[N][16];
+
+static void
+check(struct map *h)
+{
+	size_t i, j, len, dist;
+
+	len = 0;
+	for (i = 0; i < h->cap; ++i) {
+		j = i + 1 & h->cap - 1;
+		if (!h->ctrl[i]) {
+			if (h->ctrl[j] >> 8 > 1)
+				fatal("entry %zu follows an empty slot but is not in its home slot", j);
+			continue;
+		}
+		++len;
+		dist = (h->ctrl[i] >> 8) - 1;
+		if ((h->slots[i].key.hash & h->cap - 1) != (i - dist & h->cap - 1))
+			fatal("entry %zu has wrong probe distance %zu", i, dist);
+		if ((h->ctrl[i] & 0xff) != (h->slots[i].key.hash >> 24 & 0xff))
+			fatal("entry %zu has wrong fingerprint", i);
+		if (h->ctrl[j] >> 8 > (h->ctrl[i] >> 8) + 1)
+			fatal("entry %zu is out of order", j);
+	}
+	if (len != h->len)
+		fatal("map has %zu entries, expected %zu", len, h->len);
+}
+
+static void
+lookup(struct map *h, size_t i, int present)
+{
+	struct mapkey k;
+	char *v;
+
+	mapkey(&k, keys[i], strlen(keys[i]));
+	v = mapget(h, &k);
+	if (present ? v != keys[i] : v != NULL)
+		fatal("lookup of %s failed", keys[i]);
+}
+
+int
+main(void)
+{
+	static char present[N];
+	struct map h;
+	struct mapkey k;
+	size_t i, j, n;
+
+	argv0 = "map-test";
+	mapinit(&h, 16);
+	for (i = 0; i < N; ++i) {
+		snprintf(keys[i], sizeof(keys[i]), "key%zu", i);
+		mapkey(&k, keys[i], strlen(keys[i]));
+		*mapput(&h, &k) = keys[i];
+		present[i] = 1;
+	}
+	check(&h);
+	/* delete and reinsert keys in a scattered order */
+	for (n = 0, j = 0; n < 4 * N; ++n) {
+		j = (j * 1103515245 + 12345) % N;
+		mapkey(&k, keys[j], strlen(keys[j]));
+		if (present[j]) {
+			if (mapdel(&h, &k) != keys[j])
+				fatal("delete of %s failed", keys[j]);
+			present[j] = 0;
+		} else if (n % 3 == 0) {
+			*mapput(&h, &k) = keys[j];
+			present[j] = 1;
+		}
+		if (n % 997 == 0)
+			check(&h);
+	}
+	check(&h);
+	for (i = 0; i < N; ++i)
+		lookup(&h, i, present[i]);
+	/* remove most keys, then shrink */
+	for (i = 0; i < N; ++i) {
+		if (present[i] && i % 16 != 0) {
+			mapkey(&k, keys[i], strlen(keys[i]));
+			mapdel(&h, &k);
+			present[i] = 0;
+		}
+	}
+	n = h.cap;
+	mapshrink(&h);
+	if (h.cap >= n)
+		fatal("map did not shrink");
+	check(&h);
+	for (i = 0; i < N; ++i)
+		lookup(&h, i, present[i]);
+	mapfree(&h, NULL);
+	return 0;
+}
+END
+
+if $CC -I . -o "$dir/map-test" "$dir/map-test.c" map.c util.c && "$dir/map-test" ; then
+	echo "[PASS] $0" >&2
+else
+	echo "[FAIL] $0" >&2
+	exit 1
+fi
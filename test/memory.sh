@@ -0,0 +1,28 @@
+#!/bin/sh
+# Check that memory use does not grow with the number of functions in
+# a translation unit by compiling many functions in a limited address
+# space. If memory were not reclaimed after each function, this would
+# need over 60 MB.
+
+: ${CCQBE:=./cproc-qbe}
+
+src=$(mktemp)
+trap 'rm "$src"' EXIT
+
+awk 'BEGIN {
+	for (i = 0; i < 20000; ++i) {
+		printf "int f%d(int a, int *p) {\n", i
+		printf "\tint x = a * %d, y[4] = {1, 2, 3, 4};\n", i
+		printf "\tstruct s { int m; long n; } s = {a, %d};\n", i
+		printf "\tswitch (a) { case 1: x += 2; break; case 2: x -= y[1]; break; default: x ^= s.m; }\n"
+		printf "\tfor (int j = 0; j < a; ++j) { if (p[j] > x) x = p[j] + (int)s.n; else goto out; }\n"
+		printf "out:\n\treturn x + *p + sizeof(y);\n}\n"
+	}
+}' > "$src"
+
+if (ulimit -v 40960 && $CCQBE -o /dev/null "$src") ; then
+	echo "[PASS] $0" >&2
+else
+	echo "[FAIL] $0" >&2
+	exit 1
+fi
@@ -0,0 +1,5 @@
+#define M "llu"
+"a""b"
+"%"M"\n"
+'a''b'
+1.0f"x"
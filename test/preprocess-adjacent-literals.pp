@@ -0,0 +1,4 @@
+"a""b"
+"%""llu""\n"
+'a''b'
+1.0f"x"
@@ -0,0 +1,29 @@
+#define x 3
+#if x > 2 && defined(x) && !defined y
+a
+#elif 1/0
+b
+#else
+c
+#endif
+#ifdef y
+d
+#if 1
+#error not reached
+#endif
+#elif (y + 1 == 1 ? 1 : 0)
+e
+#endif
+#ifndef x
+f
+#else
+g
+#endif
+#if -1 < 0u
+h
+#elif 'a' == 97 && 0x10 == 16 && (-1 >> 1) == -1 && 7 % 3 == 1
+i
+#endif
+#if 0 && 1/0
+j
+#endif
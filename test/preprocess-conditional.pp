@@ -0,0 +1,4 @@
+a
+e
+g
+i
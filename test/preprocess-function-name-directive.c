@@ -0,0 +1,7 @@
+#define f(x) x
+f
+#define A 1
+A
+f
+#undef f
+f(A)
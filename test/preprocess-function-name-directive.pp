@@ -0,0 +1,4 @@
+f
+1
+f
+f(1)
@@ -0,0 +1,9 @@
+#define F(x) x
+#if F
+bad
+#else
+good
+#endif
+#if F
+(1)
+#endif
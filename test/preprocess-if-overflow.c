@@ -0,0 +1,10 @@
+#if (-9223372036854775807-1) / -1 < 0
+overflow
+#endif
+#if (-9223372036854775807-1) % -1 == 0
+zero
+#endif
+#if 0 && (-9223372036854775807-1) / -1
+#else
+unevaluated
+#endif
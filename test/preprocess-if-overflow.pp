@@ -0,0 +1,3 @@
+overflow
+zero
+unevaluated
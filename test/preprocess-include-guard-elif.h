@@ -0,0 +1,6 @@
+#ifndef GUARD_ELIF_H
+#define GUARD_ELIF_H
+int c;
+#elif 1
+int d;
+#endif
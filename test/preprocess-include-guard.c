@@ -0,0 +1,10 @@
+#include "preprocess-include-guard.h"
+#include "preprocess-include-guard.h"
+#include "preprocess-include-once.h"
+#include "preprocess-include-once.h"
+#undef GUARD_H
+#include "preprocess-include-guard.h"
+#include "preprocess-include-guard-else.h"
+#include "preprocess-include-guard-else.h"
+#include "preprocess-include-guard-elif.h"
+#include "preprocess-include-guard-elif.h"
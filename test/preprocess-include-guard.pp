@@ -0,0 +1,7 @@
+guarded
+once
+guarded
+int a;
+int b;
+int c;
+int d;
@@ -0,0 +1,4 @@
+#define H "preprocess-include.h"
+#include H
+#define STR(x) #x
+#include STR(preprocess-include.h)
@@ -0,0 +1,3 @@
+#include "preprocess-include-no-newline.h"
+#define A 1
+A
@@ -0,0 +1 @@
+int x;
\ No newline at end of file
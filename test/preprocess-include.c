@@ -0,0 +1,3 @@
+foo
+#include "preprocess-include.h"
+baz
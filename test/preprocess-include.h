@@ -0,0 +1,2 @@
+#define baz qux
+bar
@@ -0,0 +1,13 @@
+#define cat(a, b) a ## b
+#define xcat(a, b) cat(a, b)
+#define t(x, y, z) x ## y ## z
+#define ab 42
+#define obj a ## b
+#define hash_hash # ## #
+#define mkstr(a) # a
+#define in_between(a) mkstr(a)
+#define join(c, d) in_between(c hash_hash d)
+cat(1, 0) xcat(cat(1, 2), 3) cat(a, b) obj
+t(1, 2, 3) t(, 4, 5) t(6, , 7) t(8, 9, ) t(10, , ) t(, , )
+cat(<, <) cat(-, =) cat(prefix_, cat(a, b))
+join(x, y)
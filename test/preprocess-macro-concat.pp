@@ -0,0 +1,4 @@
+10 123 42 42
+123 45 67 89 10
+<< -= prefix_cat(a, b)
+"x ## y"
@@ -0,0 +1,4 @@
+#define f(x) [x]
+f
+#define g 1
+(g)
@@ -0,0 +1,15 @@
+#if 0
+it's
+"unterminated
+'\q' "\x"
+/*
+#endif
+*/
+#else
+included
+#endif
+#ifdef UNDEFINED
+don't
+#elif 1
+elif
+#endif
@@ -1,4 +1,4 @@
-/* C11 6.10.3.5p5 with token concatenation disabled for now */
+/* C11 6.10.3.5p5 */
 #define    x          3
 #define    f(a)       f(x * (a))
 #undef     x
@@ -11,10 +11,10 @@
 #define    t(a)       a
 #define    p()        int
 #define    q(x)       x
-//#define    r(x,y)     x ## y
+#define    r(x,y)     x ## y
 #define    str(x)     # x
 f(y+1) + f(f(z)) % t(t(g)(0) + t)(1);
 g(x+(3,4)-w) | h 5) & m
 	(f)^m(m);
-p() i[q()] = { q(1), /*r(2,3), r(4,), r(,5), r(,)*/ };
+p() i[q()] = { q(1), r(2,3), r(4,), r(,5), r(,) };
 char c[2][6] = { str(hello), str() };
@@ -0,0 +1,3 @@
+#define M "llu"
+char s[] = "abc""def";
+char f[] = "%"M"\n";
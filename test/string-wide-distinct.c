@@ -0,0 +1,3 @@
+int *a = L"abcd";
+int *b = L"abce";
+int *c = L"abcd";
@@ -0,0 +1,22 @@
+struct s {
+	int m0, m1, m2, m3, m4, m5, m6, m7, m8, m9;
+	union {
+		long a;
+		struct {
+			short b, c;
+		};
+	};
+	int m10, m11, m12, m13, m14, m15, m16, m17, m18, m19;
+} x = {
+	.m19 = 19,
+	.c = 2,
+	.m0 = 0,
+	.m10 = 10,
+};
+static_assert(__builtin_offsetof(struct s, c) == 42);
+static_assert(__builtin_offsetof(struct s, m19) == 84);
+int
+f(struct s *p)
+{
+	return p->m17 + p->b;
+}
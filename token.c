@@ -1,13 +1,32 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
 #include "util.h"
 #include "cc.h"
 
 struct token tok;
+static struct map atoms;
+
+/* preprocessor output */
+static struct {
+	char buf[1 << 16];
+	size_t len;
+	/* offset of the current line in buf, or -1 if part of it was written */
+	size_t line;
+	/* source location of the current line of output, for linemarkers */
+	const char *file;
+	size_t lineno;
+} out;
 
 const char *tokstr[] = {
 	/* keyword */
@@ -120,13 +139,118 @@ const char *tokstr[] = {
 	[THASHHASH] = "##",
 };
 
+/* get the unique atom with the given spelling */
+struct atom *
+intern(const char *str, size_t len)
+{
+	struct mapkey k;
+	struct atom *a;
+
+	if (!atoms.cap)
+		mapinit(&atoms, 1<<10);
+	mapkey(&k, str, len);
+	a = mapget(&atoms, &k);
+	if (a)
+		return a;
+	a = xmalloc(sizeof(*a) + len + 1);
+	a->kind = TIDENT;
+	a->macro = NULL;
+	a->decl = NULL;
+	a->tag = NULL;
+	memcpy(a->name, str, len);
+	a->name[len] = '\0';
+	a->key = k;
+	a->key.str = a->name;
+	*mapput(&atoms, &a->key) = a;
+
+	return a;
+}
+
+static void
+outwrite(size_t len)
+{
+	ssize_t ret;
+	char *pos;
+
+	for (pos = out.buf; pos != out.buf + len; pos += ret) {
+		ret = write(fileno(stdout), pos, out.buf + len - pos);
+		if (ret < 0) {
+			if (errno == EINTR)
+				ret = 0;
+			else
+				fatal("write:");
+		}
+	}
+	memmove(out.buf, out.buf + len, out.len - len);
+	out.len -= len;
+	out.line = out.line == -1 ? -1 : out.line - len;
+}
+
+/* make room for n bytes in the output buffer */
+static void
+outreserve(size_t n)
+{
+	if (sizeof(out.buf) - out.len >= n)
+		return;
+	/* keep the current line, so a linemarker can still be inserted before it */
+	if (out.line != -1 && out.line > 0)
+		outwrite(out.line);
+	if (sizeof(out.buf) - out.len < n) {
+		outwrite(out.len);
+		out.line = -1;
+	}
+}
+
+/*
+insert blank lines or a linemarker before the current line if it
+does not come from the expected location (the newline token ending
+it is located at the start of the next line)
+*/
+static void
+outlinemarker(const struct location *loc)
+{
+	char marker[32];
+	size_t line, n, filelen, len;
+
+	line = loc->line - 1;
+	filelen = 0;
+	if (out.file && strcmp(out.file, loc->file) == 0 && line >= out.lineno && line - out.lineno <= 8) {
+		n = line - out.lineno;
+		len = n;
+	} else {
+		n = snprintf(marker, sizeof(marker), "# %zu \"", line);
+		filelen = strlen(loc->file);
+		len = n + filelen + 2;
+	}
+	if (len > 0 && out.line != -1 && len <= sizeof(out.buf) / 2)
+		outreserve(len);
+	if (len > 0 && (out.line == -1 || len > sizeof(out.buf) / 2)) {
+		/* the start of the line was already written, so mark the next one instead */
+		out.file = NULL;
+		return;
+	}
+	out.file = loc->file;
+	out.lineno = loc->line;
+	if (len == 0)
+		return;
+	memmove(out.buf + out.line + len, out.buf + out.line, out.len - out.line);
+	if (len > n) {
+		memcpy(out.buf + out.line, marker, n);
+		memcpy(out.buf + out.line + n, loc->file, filelen);
+		memcpy(out.buf + out.line + n + filelen, "\"\n", 2);
+	} else {
+		memset(out.buf + out.line, '\n', len);
+	}
+	out.len += len;
+}
+
+/* append a token to the preprocessor output, which is written in large blocks */
 void
 tokenprint(const struct token *t)
 {
 	const char *str;
+	size_t len;
 
-	if (t->space)
-		fputc(' ', stdout);
 	switch (t->kind) {
 	case TIDENT:
 	case TNUMBER:
@@ -144,7 +268,26 @@ tokenprint(const struct token *t)
 	}
 	if (!str)
 		fatal("cannot print token %d", t->kind);
-	fputs(str, stdout);
+	/* in linemarker mode, empty lines are left out */
+	if (t->kind == TNEWLINE && ppflags & PPLINEMARKERS && out.len == out.line)
+		return;
+	len = strlen(str);
+	outreserve(len + 1);
+	if (t->space)
+		out.buf[out.len++] = ' ';
+	memcpy(out.buf + out.len, str, len);
+	out.len += len;
+	if (t->kind == TNEWLINE) {
+		if (ppflags & PPLINEMARKERS)
+			outlinemarker(&t->loc);
+		out.line = out.len;
+	}
+}
+
+void
+tokenflush(void)
+{
+	outwrite(out.len);
 }
 
 static void
@@ -201,3 +344,14 @@ void error(const struct location *loc, const char *fmt, ...)
 	putc('\n', stderr);
 	exit(1);
 }
+
+void warning(const struct location *loc, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "%s:%zu:%zu: warning: ", loc->file, loc->line, loc->col);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	putc('\n', stderr);
+}
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include "util.h"
 #include "cc.h"
@@ -46,17 +48,58 @@ struct type typenullptr = {.kind = TYPENULLPTR, .size = 8, .align = 8, .prop = P
 unsigned int ptrsize;
 struct type *typeadjvalist;
 
+/*
+Results of typecompatible for distinct function types, which must
+compare their parameter lists, are kept in a small direct-mapped
+cache. It is cleared when an array type is completed, and entries
+for local types are dropped when those are released.
+*/
+static struct compat {
+	struct type *t1, *t2;
+	bool compatible, local;
+} compatcache[1024];
+/* statistics reported with typestats */
+static struct {
+	unsigned long hits, misses;
+} stats;
+
 struct type *
 mktype(enum typekind kind, enum typeprop prop)
 {
 	struct type *t;
 
-	t = xmalloc(sizeof(*t));
+	t = arenaalloc(funcarena, sizeof(*t));
 	t->kind = kind;
 	t->prop = prop;
 	t->value = NULL;
 	t->incomplete = false;
 	t->flexible = false;
+	t->local = funcarena != &tuarena;
+	t->derived = NULL;
+
+	return t;
+}
+
+/*
+Allocate a type derived from base. If intern is set, the type is
+linked into the derived list of base and allocated in the same
+arena, so that it can be reused for as long as base is alive.
+*/
+static struct type *
+mkderivedtype(enum typekind kind, enum typeprop prop, struct type *base, bool intern)
+{
+	struct arena *arena;
+	struct type *t;
+
+	arena = funcarena;
+	if (intern && !base->local)
+		funcarena = &tuarena;
+	t = mktype(kind, prop);
+	funcarena = arena;
+	if (intern) {
+		t->sibling = base->derived;
+		base->derived = t;
+	}
 
 	return t;
 }
@@ -66,7 +109,13 @@ mkpointertype(struct type *base, enum typequal qual)
 {
 	struct type *t;
 
-	t = mktype(TYPEPOINTER, PROPSCALAR);
+	if (base) {
+		for (t = base->derived; t; t = t->sibling) {
+			if (t->kind == TYPEPOINTER && t->qual == qual)
+				return t;
+		}
+	}
+	t = mkderivedtype(TYPEPOINTER, PROPSCALAR, base, base != NULL);
 	t->base = base;
 	t->qual = qual;
 	t->size = ptrsize;
@@ -81,8 +130,21 @@ struct type *
 mkarraytype(struct type *base, enum typequal qual, unsigned long long len)
 {
 	struct type *t;
-
-	t = mktype(TYPEARRAY, 0);
+	bool intern;
+
+	/*
+	incomplete arrays are completed in place by initializers,
+	and variable length arrays get their size computed by the
+	backend, so only intern arrays of known constant size
+	*/
+	intern = base && len && base->size && !(base->prop & PROPVM);
+	if (intern) {
+		for (t = base->derived; t; t = t->sibling) {
+			if (t->kind == TYPEARRAY && t->qual == qual && t->size == base->size * len)
+				return t;
+		}
+	}
+	t = mkderivedtype(TYPEARRAY, 0, base, intern);
 	t->base = base;
 	t->qual = qual;
 	t->u.array.length = NULL;
@@ -114,11 +176,36 @@ typerank(struct type *t)
 	return 0;
 }
 
+static struct compat *
+compatslot(struct type *t1, struct type *t2)
+{
+	uint_least64_t h;
+
+	/* symmetric in t1 and t2 */
+	h = ((uintptr_t)t1 ^ (uintptr_t)t2) * 0x9e3779b97f4a7c15;
+	return &compatcache[h >> 54];
+}
+
+static bool
+funccompatible(struct type *t1, struct type *t2)
+{
+	size_t i;
+
+	if (t1->u.func.isvararg != t2->u.func.isvararg || t1->u.func.nparam != t2->u.func.nparam)
+		return false;
+	for (i = 0; i < t1->u.func.nparam; ++i) {
+		if (!typecompatible(t1->u.func.params[i]->type, t2->u.func.params[i]->type))
+			return false;
+	}
+	return t1->qual == t2->qual && typecompatible(t1->base, t2->base);
+}
+
 bool
 typecompatible(struct type *t1, struct type *t2)
 {
-	struct decl *p1, *p2;
 	struct expr *e1, *e2;
+	struct compat *c;
+	bool compatible;
 
 	if (t1 == t2)
 		return true;
@@ -137,27 +224,54 @@ typecompatible(struct type *t1, struct type *t2)
 	case TYPEARRAY:
 		if (t1->incomplete || t2->incomplete)
 			goto derived;
+		if (!(t1->prop & PROPVM) && !(t2->prop & PROPVM)) {
+			if (t1->size != t2->size)
+				return false;
+			goto derived;
+		}
 		e1 = t1->u.array.length;
 		e2 = t2->u.array.length;
 		if (e1 && e2 && e1->kind == EXPRCONST && e2->kind == EXPRCONST && e1->u.constant.u != e2->u.constant.u)
 			return false;
 		goto derived;
 	case TYPEFUNC:
-		if (t1->u.func.isvararg != t2->u.func.isvararg)
-			return false;
-		for (p1 = t1->u.func.params, p2 = t2->u.func.params; p1 && p2; p1 = p1->next, p2 = p2->next) {
-			if (!typecompatible(p1->type, p2->type))
-				return false;
+		c = compatslot(t1, t2);
+		if (c->t1 == t1 && c->t2 == t2 || c->t1 == t2 && c->t2 == t1) {
+			++stats.hits;
+			return c->compatible;
 		}
-		if (p1 || p2)
-			return false;
-		goto derived;
+		++stats.misses;
+		/* the slot may be reused while comparing parameters */
+		compatible = funccompatible(t1, t2);
+		c->t1 = t1;
+		c->t2 = t2;
+		c->compatible = compatible;
+		c->local = t1->local || t2->local;
+		return compatible;
 	derived:
 		return t1->qual == t2->qual && typecompatible(t1->base, t2->base);
 	}
 	return false;
 }
 
+/* forget cached results for local types, or for all types if all is set */
+void
+typeclearcache(bool all)
+{
+	struct compat *c;
+
+	for (c = compatcache; c < compatcache + LEN(compatcache); ++c) {
+		if (all || c->local)
+			c->t1 = c->t2 = NULL;
+	}
+}
+
+void
+typestats(FILE *f)
+{
+	fprintf(f, "type cache:    %lu hits, %lu misses\n", stats.hits, stats.misses);
+}
+
 bool
 typesame(struct type *t1, struct type *t2)
 {
@@ -242,15 +356,103 @@ typeadjust(struct type *t, enum typequal *tq)
 	return t;
 }
 
+/*
+Structs and unions with many members get an open-addressed hash
+index from member name to the member and its offset, allocated along
+with the type. Members of anonymous structs and unions are included,
+along with the top-level anonymous member containing them.
+*/
+struct memberindex {
+	size_t mask;
+	struct memberentry {
+		const char *name;
+		struct member *mem, *top;
+		unsigned long long offset;
+	} ent[];
+};
+
+static struct memberentry *
+memberslot(struct memberindex *idx, const char *name)
+{
+	struct memberentry *e;
+	size_t i;
+
+	for (i = atomof(name)->key.hash;; ++i) {
+		e = &idx->ent[i & idx->mask];
+		if (!e->name || e->name == name)
+			return e;
+	}
+}
+
+static void
+indexmembers(struct memberindex *idx, struct member *top, struct type *t, unsigned long long offset)
+{
+	struct member *m;
+	struct memberentry *e;
+
+	for (m = t->u.structunion.members; m < t->u.structunion.members + t->u.structunion.nmember; ++m) {
+		if (!m->name) {
+			indexmembers(idx, top ? top : m, m->type, offset + m->offset);
+			continue;
+		}
+		e = memberslot(idx, m->name);
+		if (e->name)  /* keep the first, as found by a linear search */
+			continue;
+		e->name = m->name;
+		e->mem = m;
+		e->top = top ? top : m;
+		e->offset = offset + m->offset;
+	}
+}
+
+static size_t
+countmembers(struct type *t)
+{
+	struct member *m;
+	size_t n;
+
+	n = 0;
+	for (m = t->u.structunion.members; m < t->u.structunion.members + t->u.structunion.nmember; ++m)
+		n += m->name ? 1 : countmembers(m->type);
+	return n;
+}
+
+void
+typeindexmembers(struct type *t)
+{
+	struct memberindex *idx;
+	size_t n, cap;
+
+	assert(t->kind == TYPESTRUCT || t->kind == TYPEUNION);
+	n = countmembers(t);
+	if (n <= 16)
+		return;
+	for (cap = 32; cap < n * 2; cap *= 2)
+		;
+	idx = arenaalloc(funcarena, sizeof(*idx) + cap * sizeof(idx->ent[0]));
+	idx->mask = cap - 1;
+	memset(idx->ent, 0, cap * sizeof(idx->ent[0]));
+	indexmembers(idx, NULL, t, 0);
+	t->u.structunion.index = idx;
+}
+
 struct member *
 typemember(struct type *t, const char *name, unsigned long long *offset)
 {
 	struct member *m, *sub;
+	struct memberentry *e;
 
 	assert(t->kind == TYPESTRUCT || t->kind == TYPEUNION);
-	for (m = t->u.structunion.members; m; m = m->next) {
+	if (t->u.structunion.index) {
+		e = memberslot(t->u.structunion.index, name);
+		if (!e->name)
+			return NULL;
+		*offset += e->offset;
+		return e->mem;
+	}
+	for (m = t->u.structunion.members; m < t->u.structunion.members + t->u.structunion.nmember; ++m) {
 		if (m->name) {
-			if (strcmp(m->name, name) == 0) {
+			if (m->name == name) {
 				*offset += m->offset;
 				return m;
 			}
@@ -265,6 +467,26 @@ typemember(struct type *t, const char *name, unsigned long long *offset)
 	return NULL;
 }
 
+/* the member of t that is, or is an anonymous member containing, the named member */
+struct member *
+typedirectmember(struct type *t, const char *name)
+{
+	struct member *m;
+	struct memberentry *e;
+	unsigned long long offset;
+
+	assert(t->kind == TYPESTRUCT || t->kind == TYPEUNION);
+	if (t->u.structunion.index) {
+		e = memberslot(t->u.structunion.index, name);
+		return e->name ? e->top : NULL;
+	}
+	for (m = t->u.structunion.members; m < t->u.structunion.members + t->u.structunion.nmember; ++m) {
+		if (m->name ? m->name == name : typemember(m->type, name, &offset) != NULL)
+			return m;
+	}
+	return NULL;
+}
+
 bool
 typehasint(struct type *t, unsigned long long i, bool sign)
 {
@@ -142,3 +142,55 @@ listremove(struct list *list)
 	list->prev->next = list->next;
 	list->next = list->prev = NULL;
 }
+
+struct arenablock {
+	struct arenablock *next;
+	char *end;
+	union {
+		long double d;
+		long long i;
+		void *p;
+	} data[];
+};
+
+void *
+arenaalloc(struct arena *a, size_t n)
+{
+	struct arenablock *b, *next;
+	size_t size;
+	void *v;
+
+	n = ALIGNUP(n, sizeof(b->data[0]));
+	if ((size_t)(a->end - a->pos) < n) {
+		/* blocks after a released position are reused if they are large enough */
+		next = a->block ? a->block->next : a->first;
+		if (next && (size_t)(next->end - (char *)next->data) >= n) {
+			b = next;
+		} else {
+			size = n > 1 << 16 ? n : 1 << 16;
+			b = xmalloc(sizeof(*b) + size);
+			b->end = (char *)b->data + size;
+			b->next = next;
+			if (a->block)
+				a->block->next = b;
+			else
+				a->first = b;
+		}
+		a->block = b;
+		a->pos = (char *)b->data;
+		a->end = b->end;
+	}
+	v = a->pos;
+	a->pos += n;
+
+	return v;
+}
+
+/* release everything allocated since the arena was in the state m */
+void
+arenarelease(struct arena *a, struct arena *m)
+{
+	a->block = m->block;
+	a->pos = m->pos;
+	a->end = m->end;
+}
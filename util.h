@@ -39,12 +39,24 @@ void arrayaddbuf(struct array *, const void *, size_t);
 void *arraylast(struct array *, size_t);
 #define arrayforeach(a, m) for (m = (a)->val; m != (void *)((char *)(a)->val + (a)->len); ++m)
 
+/* arena */
+
+struct arena {
+	struct arenablock *first, *block;
+	/* free space in the current block */
+	char *pos, *end;
+};
+
+void *arenaalloc(struct arena *, size_t);
+void arenarelease(struct arena *, struct arena *);
+
 /* map */
 
 struct map {
 	size_t len, cap;
-	struct mapkey *keys;
-	void **vals;
+	/* probe distance and hash fingerprint of each slot */
+	unsigned *ctrl;
+	struct mapslot *slots;
 };
 
 struct mapkey {
@@ -53,11 +65,18 @@ struct mapkey {
 	size_t len;
 };
 
+struct mapslot {
+	struct mapkey key;
+	void *val;
+};
+
 void mapkey(struct mapkey *, const void *, size_t);
 void mapinit(struct map *, size_t);
 void mapfree(struct map *, void(void *));
 void **mapput(struct map *, struct mapkey *);
 void *mapget(struct map *, struct mapkey *);
+void *mapdel(struct map *, struct mapkey *);
+void mapshrink(struct map *);
 
 /* tree */
 